@@ -0,0 +1,239 @@
+/***********************************************************************************
+ File: alloc_trace.c
+
+ This file contains the implementation of the alloc_trace module. Thread buffers
+ are allocated with the system malloc() so that recording never re-enters the
+ allocator being traced. Buffers are registered in a list so trace_stop() can
+ flush them, and are only freed on thread exit. A forked child stops recording,
+ the trace stays with the parent.
+***********************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "alloc_trace.h"
+
+
+/* Per-thread event buffer */
+typedef struct TraceBuffer {
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+    unsigned int count; /* Events waiting to be flushed */
+    uint16_t thread; /* Thread number stamped on every event */
+    struct TraceBuffer* next; /* Next buffer in trace_buffers */
+} TraceBuffer;
+
+
+volatile int trace_enabled = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* trace_file = NULL;
+static TraceBuffer* trace_buffers = NULL;
+static uint16_t trace_thread_count = 0;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_once_t trace_fork_once = PTHREAD_ONCE_INIT;
+static __thread TraceBuffer* thread_buffer = NULL;
+
+
+/* Write out the buffered events of _buffer, trace_lock must be held */
+static void flush_buffer(TraceBuffer* _buffer) {
+    if (trace_file != NULL && _buffer->count > 0) {
+        fwrite(_buffer->events, sizeof(TraceEvent), _buffer->count, trace_file);
+    }
+
+    _buffer->count = 0;
+}
+
+
+/* Thread exit: flush and unregister the thread's buffer */
+static void release_buffer(void* _buffer) {
+    TraceBuffer** link = &trace_buffers;
+
+    pthread_mutex_lock(&trace_lock);
+
+    flush_buffer((TraceBuffer*)_buffer);
+
+    while (*link != NULL && *link != _buffer) {
+        link = &(*link)->next;
+    }
+
+    if (*link != NULL) {
+        *link = (*link)->next;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+
+    free(_buffer);
+}
+
+
+/* Fork: the lock is held across the fork, and the trace file is flushed so its
+   stdio buffer is not written out by both processes */
+static void trace_fork_prepare(void) {
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_file != NULL) {
+        fflush(trace_file);
+    }
+}
+
+
+static void trace_fork_parent(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+/* The trace belongs to the parent, the child stops recording and drops the
+   events its copies of the buffers still hold */
+static void trace_fork_child(void) {
+    TraceBuffer* buffer = NULL;
+
+    trace_enabled = 0;
+
+    for (buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+        buffer->count = 0;
+    }
+
+    if (trace_file != NULL) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+
+    pthread_mutex_init(&trace_lock, NULL);
+}
+
+
+static void register_trace_fork_handlers(void) {
+    pthread_atfork(trace_fork_prepare, trace_fork_parent, trace_fork_child);
+}
+
+
+static void create_trace_key(void) {
+    pthread_key_create(&trace_key, release_buffer);
+}
+
+
+/* Allocate and register the calling thread's buffer, NULL if out of memory */
+static TraceBuffer* create_buffer(void) {
+    TraceBuffer* buffer = (TraceBuffer*) malloc(sizeof(TraceBuffer));
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    pthread_once(&trace_key_once, create_trace_key);
+
+    pthread_mutex_lock(&trace_lock);
+
+    buffer->count = 0;
+    buffer->thread = trace_thread_count++;
+    buffer->next = trace_buffers;
+    trace_buffers = buffer;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(trace_key, buffer);
+
+    return buffer;
+}
+
+
+int trace_start(const char* _path) {
+    TraceFileHeader header;
+
+    pthread_once(&trace_fork_once, register_trace_fork_handlers);
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_file != NULL) {
+        printf("\n!--- FAIL (trace_start): A trace is already being recorded. ---!\n");
+        goto error;
+    }
+
+    trace_file = fopen(_path, "wb");
+
+    if (trace_file == NULL) {
+        printf("\n!--- FAIL (trace_start): Cannot open trace file. ---!\n");
+        goto error;
+    }
+
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.event_size = sizeof(TraceEvent);
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    trace_enabled = 1;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    return 0;
+
+error:
+    pthread_mutex_unlock(&trace_lock);
+    return 1;
+}
+
+
+int trace_stop(void) {
+    TraceBuffer* buffer = NULL;
+    int result = 0;
+
+    trace_enabled = 0;
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_file == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return 1;
+    }
+
+    for (buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+        flush_buffer(buffer);
+    }
+
+    if (fclose(trace_file) != 0) {
+        printf("\n!--- FAIL (trace_stop): Problem writing trace file. ---!\n");
+        result = 1;
+    }
+
+    trace_file = NULL;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    return result;
+}
+
+
+void trace_record(char _op, void* _addr, unsigned int _size) {
+    TraceBuffer* buffer = thread_buffer;
+    TraceEvent* event = NULL;
+    struct timespec now;
+
+    if (buffer == NULL) {
+        buffer = thread_buffer = create_buffer();
+
+        if (buffer == NULL) {
+            return;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    event = &buffer->events[ buffer->count ];
+    event->timestamp = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+    event->address = (uint64_t)(uintptr_t)_addr;
+    event->size = _size;
+    event->thread = buffer->thread;
+    event->op = _op;
+    event->pad = 0;
+
+    if (++buffer->count == TRACE_BUFFER_EVENTS) {
+        pthread_mutex_lock(&trace_lock);
+        flush_buffer(buffer);
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
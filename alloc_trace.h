@@ -0,0 +1,84 @@
+/***********************************************************************************
+ File: alloc_trace.h
+
+ This file contains the declarations for the alloc_trace module, a binary
+ recorder of my_malloc/my_free events. Every thread logs into its own buffer,
+ which is appended to the trace file when full, on thread exit, and on
+ trace_stop(). Traces are re-executed by the trace_replay program.
+
+ Trace file layout: one TraceFileHeader followed by TraceEvent records, grouped
+ per thread flush. Sort by timestamp to recover the global order.
+***********************************************************************************/
+
+
+/*--------------------------------------------------------------------------------*/
+/* DEFINES */
+/*--------------------------------------------------------------------------------*/
+
+#ifndef __Memory_Allocator__C___alloc_trace__
+#define __Memory_Allocator__C___alloc_trace__
+#define TRACE_MAGIC "FIBTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_EVENTS 4096 /* Events buffered per thread between flushes */
+
+/*--------------------------------------------------------------------------------*/
+/* INCLUDES */
+/*--------------------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*--------------------------------------------------------------------------------*/
+/* DATA STRUCTURES */
+/*--------------------------------------------------------------------------------*/
+
+/* Start of every trace file */
+typedef struct TraceFileHeader {
+    char magic[8]; /* TRACE_MAGIC, not null-terminated */
+    uint32_t version; /* TRACE_VERSION */
+    uint32_t event_size; /* sizeof(TraceEvent) of the writer */
+} TraceFileHeader;
+
+/* One allocator event, 24 bytes */
+typedef struct TraceEvent {
+    uint64_t timestamp; /* CLOCK_MONOTONIC, nanoseconds */
+    uint64_t address; /* Address returned by my_malloc or passed to my_free, 0
+                         for a failed allocation */
+    uint32_t size; /* Requested length, or the length given to my_free_sized, 0
+                      for a plain my_free */
+    uint16_t thread; /* Recording thread, numbered from 0 in order of first event */
+    char op; /* 'M'alloc or 'F'ree */
+    char pad;
+} TraceEvent;
+
+/*--------------------------------------------------------------------------------*/
+/* MODULE ALLOC_TRACE */
+/*--------------------------------------------------------------------------------*/
+
+
+/* Non-zero while a trace is being recorded; checked by the allocator before
+   calling trace_record() so that tracing costs one load when disabled */
+extern volatile int trace_enabled;
+
+
+/* Start recording allocator events to the file at _path, truncating it.
+   Returns 0 if everything ok. */
+int trace_start(const char* _path);
+
+
+/* Flush every thread's buffer, close the trace file and stop recording. Other
+   threads should not be allocating while this runs. Returns 0 if everything ok. */
+int trace_stop(void);
+
+
+/* Append one event to the calling thread's buffer */
+void trace_record(char _op, void* _addr, unsigned int _size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* defined(__Memory_Allocator__C___alloc_trace__) */
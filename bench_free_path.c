@@ -0,0 +1,191 @@
+/***********************************************************************************
+ File: bench_free_path.c
+
+ This file contains the main() function of the split/coalesce microbenchmark. A
+ fixed set of live blocks is churned, each step freeing a random slot and
+ refilling it with a new allocation of random small length, so the free lists
+ see a steady mix of exact fits, splits and coalesces. Hardware counters are
+ read with perf_event_open() and reported per operation; counters the kernel
+ refuses are shown as n/a.
+
+ Build and run, with and without the prefetch and branch hints:
+     cc -O2 bench_free_path.c my_malloc.c alloc_trace.c -lpthread -o bench_free_path
+     cc -O2 -DMY_MALLOC_NO_HINTS bench_free_path.c my_malloc.c alloc_trace.c \
+         -lpthread -o bench_free_path_nohints
+     ./bench_free_path [live blocks] [operations] [max request length]
+***********************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "my_malloc.h"
+
+
+#define COUNTER_COUNT 4
+
+
+/*--------------------------------------------------------------------------*/
+/* DATA STRUCTURES */
+/*--------------------------------------------------------------------------*/
+
+/* One hardware counter of the measurement */
+typedef struct Counter {
+    const char* name;
+    uint64_t config; /* PERF_COUNT_HW_* */
+    int fd; /* -1 when not available */
+    uint64_t value;
+} Counter;
+
+
+/*--------------------------------------------------------------------------*/
+/* LOCAL FUNCTIONS */
+/*--------------------------------------------------------------------------*/
+
+/* Open _counter for the calling thread, user space only, initially disabled */
+static void open_counter(Counter* _counter) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = _counter->config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    _counter->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    _counter->value = 0;
+}
+
+
+static void start_counters(Counter* _counters) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (_counters[i].fd >= 0) {
+            ioctl(_counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(_counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+
+static void stop_counters(Counter* _counters) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (_counters[i].fd >= 0) {
+            ioctl(_counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(_counters[i].fd, &_counters[i].value, sizeof(uint64_t)) !=
+                    sizeof(uint64_t)) {
+                close(_counters[i].fd);
+                _counters[i].fd = -1;
+            }
+        }
+    }
+}
+
+
+/* Small xorshift generator, keeps the request sequence identical across builds */
+static uint32_t next_random(uint32_t* _state) {
+    *_state ^= *_state << 13;
+    *_state ^= *_state >> 17;
+    *_state ^= *_state << 5;
+
+    return *_state;
+}
+
+
+int main(int argc, const char * argv[]) {
+    unsigned int live_blocks = (argc > 1) ? (unsigned int)atoi(argv[1]) : 4096;
+    unsigned long operations = (argc > 2) ? strtoul(argv[2], NULL, 10) : 2000000;
+    unsigned int max_length = (argc > 3) ? (unsigned int)atoi(argv[3]) : 512;
+    uint32_t state = 1138;
+    void** live = NULL;
+    HeapSnapshot snapshot;
+    struct timespec start, end;
+    Counter counters[COUNTER_COUNT] = {
+        { "cycles", PERF_COUNT_HW_CPU_CYCLES, -1, 0 },
+        { "instructions", PERF_COUNT_HW_INSTRUCTIONS, -1, 0 },
+        { "cache-misses", PERF_COUNT_HW_CACHE_MISSES, -1, 0 },
+        { "branch-misses", PERF_COUNT_HW_BRANCH_MISSES, -1, 0 }
+    };
+
+    if (live_blocks == 0 || max_length == 0) {
+        printf("Usage: %s [live blocks] [operations] [max request length]\n", argv[0]);
+        return 1;
+    }
+
+    /* Worst case every live block sits in its own largest class, leave as much
+       again for fragmentation */
+    if (init_allocator(64, live_blocks * (max_length + 64) * 4 + 1048576) == 0) {
+        return 1;
+    }
+
+    live = (void**) calloc(live_blocks, sizeof(void*));
+
+    for (unsigned int i = 0; i < live_blocks; i++) {
+        live[i] = my_malloc(1 + next_random(&state) % max_length);
+    }
+
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        open_counter(&counters[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_counters(counters);
+
+    for (unsigned long op = 0; op < operations; op++) {
+        unsigned int slot = next_random(&state) % live_blocks;
+
+        my_free(live[ slot ]);
+        live[ slot ] = my_malloc(1 + next_random(&state) % max_length);
+    }
+
+    stop_counters(counters);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    get_heap_snapshot(&snapshot, NULL, 0);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    /* One free plus one malloc per step */
+    printf("\n\n%lu free + malloc pairs, %u live blocks, requests of 1..%u bytes%s\n\n",
+           operations, live_blocks, max_length,
+#ifdef MY_MALLOC_NO_HINTS
+           ", no hints"
+#else
+           ""
+#endif
+           );
+    printf("%-16s %12.2f\n", "ns/op", seconds * 1e9 / (2.0 * operations));
+
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters[i].fd >= 0) {
+            printf("%-16s %12.2f\n", counters[i].name,
+                   (double)counters[i].value / (2.0 * operations));
+            close(counters[i].fd);
+        } else {
+            printf("%-16s %12s\n", counters[i].name, "n/a");
+        }
+    }
+
+    printf("%-16s %12.3f\n%-16s %12.3f\n", "splits/malloc",
+           (double)snapshot.split_count / (operations + live_blocks),
+           "coalesces/free", (double)snapshot.coalesce_count / operations);
+
+    for (unsigned int i = 0; i < live_blocks; i++) {
+        my_free(live[i]);
+    }
+
+    free(live);
+    release_allocator();
+
+    return 0;
+}
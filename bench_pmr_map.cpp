@@ -0,0 +1,110 @@
+/***********************************************************************************
+ File: bench_pmr_map.cpp
+
+ This file benchmarks std::map insert/erase throughput on the Fibonacci arena
+ (through fib::memory_resource and fib::allocator<T>) against
+ std::pmr::unsynchronized_pool_resource and the default heap.
+
+ Build and run:
+     cc -O2 -c my_malloc.c alloc_trace.c
+     c++ -std=c++17 -O2 bench_pmr_map.cpp my_malloc.o alloc_trace.o -lpthread -o bench_pmr_map
+     ./bench_pmr_map [keys] [rounds]
+***********************************************************************************/
+
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory_resource>
+#include <vector>
+
+#include "fib_allocator.hpp"
+
+
+/*--------------------------------------------------------------------------*/
+/* LOCAL FUNCTIONS */
+/*--------------------------------------------------------------------------*/
+
+/* Insert every key, then erase them in a different order, _rounds times.
+   Returns the number of insert + erase operations performed. */
+template <class Map>
+static unsigned long run_map(Map& _map, const std::vector<int>& _keys,
+                             const std::vector<int>& _erase_order, int _rounds) {
+    unsigned long ops = 0;
+
+    for (int r = 0; r < _rounds; r++) {
+        for (int key : _keys) {
+            _map.emplace(key, key);
+            ++ops;
+        }
+
+        for (int key : _erase_order) {
+            _map.erase(key);
+            ++ops;
+        }
+    }
+
+    return ops;
+}
+
+
+static void report(const char* _name, const std::function<unsigned long()>& _run) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    unsigned long ops = _run();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    printf("%-34s %10lu ops %9.3f s %12.0f ops/s\n",
+           _name, ops, seconds, ops / seconds);
+}
+
+
+int main(int argc, const char * argv[]) {
+    int num_keys = (argc > 1) ? atoi(argv[1]) : 10000;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+
+    std::vector<int> keys(num_keys);
+    std::vector<int> erase_order(num_keys);
+
+    srand(1138);
+    for (int i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        erase_order[i] = keys[i];
+    }
+    for (int i = num_keys - 1; i > 0; i--) {
+        std::swap(erase_order[i], erase_order[rand() % (i + 1)]);
+    }
+
+    /* Map nodes take two 64-byte blocks each, leave as much again for
+       fragmentation */
+    fib::memory_resource fib_resource(64, num_keys * 256u + 65536);
+
+    printf("\n\nstd::map<int, int>, %d keys, %d rounds\n\n", num_keys, rounds);
+
+    report("default heap", [&] {
+        std::map<int, int> map;
+        return run_map(map, keys, erase_order, rounds);
+    });
+
+    report("pmr::unsynchronized_pool_resource", [&] {
+        std::pmr::unsynchronized_pool_resource pool;
+        std::pmr::map<int, int> map(&pool);
+        return run_map(map, keys, erase_order, rounds);
+    });
+
+    report("fib::memory_resource", [&] {
+        std::pmr::map<int, int> map(&fib_resource);
+        return run_map(map, keys, erase_order, rounds);
+    });
+
+    report("fib::allocator", [&] {
+        std::map<int, int, std::less<int>,
+                 fib::allocator<std::pair<const int, int> > > map;
+        return run_map(map, keys, erase_order, rounds);
+    });
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/***********************************************************************************
+ File: fib_allocator.hpp
+
+ This file contains header-only C++ adapters for the my_malloc module:
+
+   fib::allocator<T>     satisfies the Allocator named requirements, so it can be
+                         passed directly as a container's allocator argument.
+   fib::memory_resource  a std::pmr::memory_resource for the std::pmr containers.
+
+ Both draw from the process-wide allocator set up by init_allocator(); there is
+ only one. A memory_resource constructed with a block size and length owns that
+ allocator: it initializes it on construction and releases it on destruction,
+ and refuses to be constructed while the allocator is already initialized.
+ Containers using it must be destroyed first.
+
+ Blocks are aligned to the arena's basic_block_size, so pick a basic block size
+ that is a multiple of alignof(std::max_align_t). Over-aligned requests are
+ refused with std::bad_alloc.
+***********************************************************************************/
+
+#ifndef __Memory_Allocator__C___fib_allocator__
+#define __Memory_Allocator__C___fib_allocator__
+
+/*--------------------------------------------------------------------------------*/
+/* INCLUDES */
+/*--------------------------------------------------------------------------------*/
+
+#include <cstddef>
+#include <climits>
+#include <new>
+#include <memory_resource>
+#include <stdexcept>
+
+#include "my_malloc.h"
+
+namespace fib {
+
+/*--------------------------------------------------------------------------------*/
+/* CLASS allocator<T> */
+/*--------------------------------------------------------------------------------*/
+
+template <class T>
+class allocator {
+public:
+    typedef T value_type;
+
+    allocator() noexcept {}
+
+    template <class U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t _n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t),
+                      "fib::allocator does not support over-aligned types");
+
+        if (_n > UINT_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+
+        Addr addr = my_malloc((unsigned int)(_n * sizeof(T)));
+
+        if (addr == NULL) {
+            throw std::bad_alloc();
+        }
+
+        return static_cast<T*>(addr);
+    }
+
+    void deallocate(T* _addr, std::size_t _n) noexcept {
+        my_free_sized(_addr, (unsigned int)(_n * sizeof(T)));
+    }
+};
+
+
+/* There is only one Fibonacci arena, so every fib::allocator is interchangeable */
+template <class T, class U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+    return true;
+}
+
+
+template <class T, class U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+    return false;
+}
+
+/*--------------------------------------------------------------------------------*/
+/* CLASS memory_resource */
+/*--------------------------------------------------------------------------------*/
+
+class memory_resource : public std::pmr::memory_resource {
+public:
+    /* Use the arena already set up with init_allocator() */
+    memory_resource() noexcept : owns_arena(false) {}
+
+    /* Initialize the allocator with an arena of at least _length bytes and own
+       it. Throws std::logic_error if the allocator is already initialized, by
+       init_allocator() or another owning resource. */
+    memory_resource(unsigned int _basic_block_size, unsigned int _length)
+        : owns_arena(true) {
+        if (allocator_arena_count() != 0) {
+            throw std::logic_error("fib::memory_resource: allocator already initialized");
+        }
+
+        if (init_allocator(_basic_block_size, _length) == 0) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~memory_resource() {
+        if (owns_arena) {
+            release_allocator();
+        }
+    }
+
+    memory_resource(const memory_resource&) = delete;
+    memory_resource& operator=(const memory_resource&) = delete;
+
+protected:
+    void* do_allocate(std::size_t _bytes, std::size_t _alignment) override {
+        if (_alignment > alignof(std::max_align_t) || _bytes > UINT_MAX) {
+            throw std::bad_alloc();
+        }
+
+        Addr addr = my_malloc((unsigned int)_bytes);
+
+        if (addr == NULL) {
+            throw std::bad_alloc();
+        }
+
+        return addr;
+    }
+
+    void do_deallocate(void* _addr, std::size_t _bytes, std::size_t) override {
+        my_free_sized(_addr, (unsigned int)_bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& _other) const noexcept override {
+        return dynamic_cast<const memory_resource*>(&_other) != nullptr;
+    }
+
+private:
+    bool owns_arena;
+};
+
+} /* namespace fib */
+
+#endif /* defined(__Memory_Allocator__C___fib_allocator__) */
@@ -0,0 +1,200 @@
+/***********************************************************************************
+ File: fork_check.c
+
+ This file contains the main() function of the fork and emergency pool check.
+ Worker threads churn the heap while the main thread forks children that
+ allocate, free and walk their copy of it; a child that deadlocks or finds a
+ half-updated free list fails the check. It then allocates from a signal
+ handler through the emergency pool, and exhausts the arena so my_malloc()
+ falls back to the pool. Exits with 0 if every check passes.
+
+ Build and run:
+     cc -O2 fork_check.c my_malloc.c alloc_trace.c -lpthread -o fork_check
+     ./fork_check [children]
+***********************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "my_malloc.h"
+
+
+#define WORKERS 4
+#define WORKER_SLOTS 256
+#define POOL_SLOTS 64
+#define POOL_SLOT_SIZE 256
+
+
+static volatile int stop_workers = 0;
+static volatile sig_atomic_t signal_result = 0; /* 1 ok, -1 failed */
+
+
+/*--------------------------------------------------------------------------*/
+/* LOCAL FUNCTIONS */
+/*--------------------------------------------------------------------------*/
+
+/* Allocate and free random lengths until stop_workers is set */
+static void* churn(void* _seed) {
+    unsigned int seed = (unsigned int)(size_t)_seed;
+    void* slots[ WORKER_SLOTS ] = { NULL };
+
+    while (!stop_workers) {
+        int i = rand_r(&seed) % WORKER_SLOTS;
+
+        if (slots[i] != NULL) {
+            my_free(slots[i]);
+            slots[i] = NULL;
+        } else {
+            slots[i] = my_malloc(1 + rand_r(&seed) % 2000);
+        }
+    }
+
+    for (int i = 0; i < WORKER_SLOTS; i++) {
+        if (slots[i] != NULL) {
+            my_free(slots[i]);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Child side of a fork: use the inherited heap and walk it */
+static int child_check(void) {
+    HeapSnapshot snapshot;
+    void* blocks[ 100 ];
+
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = my_malloc(100 + i);
+        if (blocks[i] == NULL) {
+            return 1;
+        }
+        memset(blocks[i], i, 100 + i);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        my_free(blocks[i]);
+    }
+
+    return get_heap_snapshot(&snapshot, NULL, 0);
+}
+
+
+static void on_signal(int _signal) {
+    void* slot = my_malloc_emergency(POOL_SLOT_SIZE);
+
+    (void)_signal;
+
+    if (slot == NULL) {
+        signal_result = -1;
+        return;
+    }
+
+    memset(slot, 0x5A, POOL_SLOT_SIZE);
+    signal_result = my_free_emergency(slot) == 0 ? 1 : -1;
+}
+
+
+static int report(const char* _name, int _passed) {
+    printf("%-44s %s\n", _name, _passed ? "PASS" : "FAIL");
+
+    return _passed ? 0 : 1;
+}
+
+
+int main(int argc, const char * argv[]) {
+    int children = (argc > 1) ? atoi(argv[1]) : 200;
+    int failed_children = 0;
+    int failures = 0;
+    int arena_blocks = 0;
+    int pool_blocks = 0;
+    void** blocks = NULL;
+    pthread_t workers[ WORKERS ];
+    HeapSnapshot snapshot;
+    char line[ 64 ];
+
+    if (init_allocator(64, 16 * 1024 * 1024) == 0 ||
+            init_emergency_pool(POOL_SLOT_SIZE, POOL_SLOTS) == 0) {
+        return 1;
+    }
+
+    /* Fork while the heap is being changed from other threads */
+    for (size_t i = 0; i < WORKERS; i++) {
+        pthread_create(&workers[i], NULL, churn, (void*)(i + 1));
+    }
+
+    for (int i = 0; i < children; i++) {
+        pid_t pid = fork();
+        int status = 0;
+
+        if (pid == 0) {
+            alarm(10); /* A deadlocked child dies and counts as failed */
+            _exit(child_check());
+        }
+
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0) {
+            ++failed_children;
+        }
+    }
+
+    stop_workers = 1;
+    for (int i = 0; i < WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    printf("\n\n");
+    snprintf(line, sizeof(line), "fork under churn (%d children)", children);
+    failures += report(line, failed_children == 0);
+
+    failures += report("parent heap coalesced after fork",
+                       get_heap_snapshot(&snapshot, NULL, 0) == 0 &&
+                       snapshot.free_bytes == snapshot.largest_free_block);
+
+    /* Emergency slot taken and returned from inside a signal handler */
+    signal(SIGUSR1, on_signal);
+    raise(SIGUSR1);
+    failures += report("allocation from a signal handler", signal_result == 1);
+
+    /* Exhaust the arena, my_malloc() then serves the pool's slots */
+    blocks = (void**) calloc(1 << 16, sizeof(void*));
+    for (int i = 0; i < (1 << 16); i++) {
+        blocks[i] = my_malloc(POOL_SLOT_SIZE);
+
+        if (blocks[i] == NULL) {
+            break;
+        }
+
+        if (my_malloc_arena(blocks[i]) >= 0) {
+            ++arena_blocks;
+        } else if (my_malloc_owns(blocks[i])) {
+            ++pool_blocks;
+        }
+    }
+
+    printf("\n");
+    failures += report("out of memory fallback to the pool", pool_blocks == POOL_SLOTS);
+
+    for (int i = 0; i < arena_blocks + pool_blocks; i++) {
+        my_free(blocks[i]);
+    }
+    free(blocks);
+
+    failures += report("heap and pool reusable after the fallback",
+                       get_heap_snapshot(&snapshot, NULL, 0) == 0 &&
+                       snapshot.free_bytes == snapshot.largest_free_block &&
+                       my_malloc_emergency(POOL_SLOT_SIZE) != NULL);
+
+    release_emergency_pool();
+    release_allocator();
+
+    printf("\n%s\n", failures ? "FAILED" : "All checks passed.");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,237 @@
+/***********************************************************************************
+ File: heap_image_check.c
+
+ This file contains the main() function of the heap image check. It builds a
+ linked list in the heap, saves a heap image, and restores it in forked children
+ that first release their inherited copy of the allocator:
+   - pinned at the saved address, where the list's pointers are still valid,
+   - with the saved address taken, where a plain restore must fail and
+     HEAP_IMAGE_REBASE must map it elsewhere, walked through offsets,
+   - from a truncated image, which must be refused.
+ Each restored heap is then churned and walked. Exits with 0 if every check
+ passes.
+
+ Build and run:
+     cc -O2 heap_image_check.c my_malloc.c alloc_trace.c -lpthread -o heap_image_check
+     ./heap_image_check [image path] [list length]
+***********************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "my_malloc.h"
+
+
+/*--------------------------------------------------------------------------*/
+/* DATA STRUCTURES */
+/*--------------------------------------------------------------------------*/
+
+/* List node, linked both by pointer and by offset from the list head */
+typedef struct Node {
+    struct Node* next;
+    long next_offset; /* 0 for the last node */
+    unsigned int value;
+    char payload[ 100 ];
+} Node;
+
+
+static const char* image_path = "/tmp/heap_image_check.img";
+static char truncated_path[ 4096 ];
+static unsigned int list_length = 10000;
+static Node* saved_head = NULL;
+static HeapSnapshot saved_snapshot;
+
+
+/*--------------------------------------------------------------------------*/
+/* LOCAL FUNCTIONS */
+/*--------------------------------------------------------------------------*/
+
+/* Count the nodes holding their expected value, following pointers or offsets */
+static unsigned int walk_list(Node* _head, int _by_offset) {
+    unsigned int count = 0;
+    Node* node = _head;
+
+    while (node != NULL && node->value == list_length - 1 - count) {
+        ++count;
+
+        if (_by_offset) {
+            node = node->next_offset ? (Node*)((char*)_head + node->next_offset) : NULL;
+        } else {
+            node = node->next;
+        }
+    }
+
+    return count;
+}
+
+
+/* Allocate, fill and free on the restored heap, then walk it. Returns 0 if the
+   heap is intact and holds the saved allocations. */
+static int churn_and_walk(void) {
+    HeapSnapshot snapshot;
+    void* blocks[ 2000 ];
+
+    for (int i = 0; i < 2000; i++) {
+        blocks[i] = my_malloc(30 + i);
+        if (blocks[i] == NULL) {
+            return 1;
+        }
+        memset(blocks[i], i, 30 + i);
+    }
+
+    for (int i = 0; i < 2000; i++) {
+        my_free(blocks[i]);
+    }
+
+    if (get_heap_snapshot(&snapshot, NULL, 0) != 0) {
+        return 1;
+    }
+
+    return snapshot.allocated_count != saved_snapshot.allocated_count;
+}
+
+
+/* Child: restore pinned and follow the list's pointers */
+static int restore_pinned(void) {
+    Addr root = NULL;
+
+    if (restore_heap_image(image_path, 0, &root) == 0) {
+        return 1;
+    }
+
+    if (walk_list((Node*)root, 0) != list_length) {
+        return 1;
+    }
+
+    return churn_and_walk();
+}
+
+
+/* Child: take the saved address, check the plain restore refuses it, then
+   rebase and follow the list's offsets */
+static int restore_rebased(void) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    void* page = (void*)((uintptr_t)saved_head & ~(uintptr_t)(page_size - 1));
+    Addr root = NULL;
+
+    if (mmap(page, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+             -1, 0) != page) {
+        return 1;
+    }
+
+    if (restore_heap_image(image_path, 0, &root) != 0) {
+        return 1;
+    }
+
+    if (restore_heap_image(image_path, HEAP_IMAGE_REBASE, &root) == 0 ||
+            root == (Addr)saved_head) {
+        return 1;
+    }
+
+    if (walk_list((Node*)root, 1) != list_length) {
+        return 1;
+    }
+
+    return churn_and_walk();
+}
+
+
+/* Child: a copy of the image cut short must be refused */
+static int restore_truncated(void) {
+    Addr root = NULL;
+
+    return restore_heap_image(truncated_path, 0, &root) != 0;
+}
+
+
+/* Run _check in a child whose inherited allocator is released first */
+static int run_child(const char* _name, int (*_check)(void)) {
+    pid_t pid = fork();
+    int status = 0;
+    int passed = 0;
+
+    if (pid == 0) {
+        release_allocator();
+        _exit(_check());
+    }
+
+    passed = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0;
+
+    printf("\n%-44s %s\n", _name, passed ? "PASS" : "FAIL");
+
+    return passed ? 0 : 1;
+}
+
+
+int main(int argc, const char * argv[]) {
+    Node* head = NULL;
+    void* others[ 500 ];
+    int failures = 0;
+
+    if (argc > 1) {
+        image_path = argv[1];
+    }
+    if (argc > 2) {
+        list_length = (unsigned int)atoi(argv[2]);
+    }
+
+    snprintf(truncated_path, sizeof(truncated_path), "%s.truncated", image_path);
+
+    if (list_length == 0 || init_allocator(64, list_length * 256 + 4 * 1024 * 1024) == 0) {
+        return 1;
+    }
+
+    /* Interleave other allocations so the free lists are not trivial */
+    for (int i = 0; i < 500; i++) {
+        others[i] = my_malloc(50 + i * 7);
+    }
+
+    for (unsigned int i = 0; i < list_length; i++) {
+        Node* node = (Node*) my_malloc(sizeof(Node));
+
+        if (node == NULL) {
+            return 1;
+        }
+
+        node->value = i;
+        node->next = head;
+        memset(node->payload, (int)i, sizeof(node->payload));
+        head = node;
+    }
+
+    for (Node* node = head; node != NULL; node = node->next) {
+        node->next_offset = node->next ? (char*)node->next - (char*)head : 0;
+    }
+
+    for (int i = 0; i < 500; i += 2) {
+        my_free(others[i]);
+    }
+
+    get_heap_snapshot(&saved_snapshot, NULL, 0);
+    saved_head = head;
+
+    if (save_heap_image(image_path, head) != 0 ||
+            save_heap_image(truncated_path, head) != 0 ||
+            truncate(truncated_path, 1024 * 1024) != 0) {
+        return 1;
+    }
+
+    failures += run_child("pinned restore keeps pointers valid", restore_pinned);
+    failures += run_child("taken address refused, then rebased", restore_rebased);
+    failures += run_child("truncated image refused", restore_truncated);
+
+    remove(image_path);
+    remove(truncated_path);
+    release_allocator();
+
+    printf("\n%s\n", failures ? "FAILED" : "All checks passed.");
+
+    return failures ? 1 : 0;
+}
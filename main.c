@@ -52,6 +52,16 @@ int main(int argc, const char * argv[]) {
     printf("\n%d", my_free(allocation1));
     show_free_list();
     
+    /* Occupancy of the arena with allocation2 and allocation4 still live */
+    HeapSnapshot snapshot;
+    unsigned char occupancy[128];
+    
+    get_heap_snapshot(&snapshot, occupancy, 128);
+    printf("\nFree: %llu bytes, largest free block: %llu bytes, fragmentation: %.2f\n",
+           snapshot.free_bytes, snapshot.largest_free_block,
+           snapshot.external_fragmentation);
+    write_heap_map_ascii(stdout, occupancy, 128, 64);
+    
     printf("\n%d", my_free(allocation4));
     show_free_list();
     
@@ -11,17 +11,147 @@
 ***********************************************************************************/
 
 
+#define _GNU_SOURCE /* sched_getcpu() */
+
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "my_malloc.h"
+#include "alloc_trace.h"
+
+
+#define MAX_CPUS 1024
+
+/* Branch hints and prefetches for the split/coalesce hot path, compile with
+   MY_MALLOC_NO_HINTS to measure without them */
+#if defined(__GNUC__) && !defined(MY_MALLOC_NO_HINTS)
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define prefetch_for_write(addr) __builtin_prefetch((addr), 1, 3)
+#else
+#define likely(x) (x)
+#define unlikely(x) (x)
+#define prefetch_for_write(addr) ((void)(addr))
+#endif
+#define MPOL_BIND 2 /* From <numaif.h>, which needs libnuma's headers */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0 /* Older headers: the address is only a hint */
+#endif
+#define HEAP_IMAGE_MAGIC "FIBHEAP"
+#define HEAP_IMAGE_VERSION 1
+
+
+/* One Fibonacci heap. init_allocator() sets up a single arena, and
+   init_numa_allocator() one per NUMA node. */
+typedef struct Arena {
+    void* allocated_memory_front;
+    void* allocated_memory_back;
+    unsigned int final_allocation_size;
+    unsigned int free_list_size;
+    Header** free_list;
+    int node; /* NUMA node the memory is bound to, -1 if unbound */
+    pthread_mutex_t lock; /* Held while the free lists are read or changed */
+    unsigned long long split_count;
+    unsigned long long coalesce_count;
+    int image_backed; /* Memory is a private mapping of a heap image file */
+} Arena;
+
+
+/* Fixed-size slots set aside for signal handlers and for my_malloc() once every
+   arena is exhausted. Slots are claimed and released with atomic operations on
+   the bitmap only, so both sides are async-signal-safe. */
+typedef struct EmergencyPool {
+    char* memory; /* Mapping: the bitmap, then the slots */
+    size_t length;
+    char* slots; /* First slot */
+    unsigned int slot_size; /* Bytes per slot, a multiple of 16 */
+    unsigned int slot_count;
+    unsigned int word_count; /* Words in used */
+    uint64_t* used; /* One bit per slot, set while allocated. Bits past
+                       slot_count are always set. */
+} EmergencyPool;
 
 
-static void* allocated_memory_front = NULL;
-static void* allocated_memory_back = NULL;
-static unsigned int final_allocation_size = 0;
+/* One arena in a heap image file. Addresses are those of the saving process. */
+typedef struct HeapImageArena {
+    uint64_t base; /* allocated_memory_front */
+    uint64_t offset; /* File offset of the arena's contents, page aligned */
+    uint32_t final_allocation_size;
+    uint32_t free_list_size;
+    int32_t node;
+    uint32_t pad;
+    uint64_t free_list[ MAX_SIZE_CLASSES ]; /* Heads, 0 for an empty list */
+    uint64_t split_count;
+    uint64_t coalesce_count;
+} HeapImageArena;
+
+/* Start of a heap image file, followed by the contents of every arena */
+typedef struct HeapImageHeader {
+    char magic[8]; /* HEAP_IMAGE_MAGIC */
+    uint32_t version; /* HEAP_IMAGE_VERSION */
+    uint32_t header_size; /* sizeof(HeapImageHeader) of the writer */
+    uint32_t basic_block_size;
+    uint32_t size_class_policy; /* SIZE_CLASS_POLICY */
+    uint32_t size_class_order; /* SIZE_CLASS_K */
+    uint32_t size_class_count;
+    uint32_t arena_count;
+    uint32_t pad;
+    uint64_t root; /* Address handed to save_heap_image() */
+    unsigned char cpu_arena[ MAX_CPUS ];
+    HeapImageArena arenas[ MAX_NUMA_NODES ];
+} HeapImageHeader;
+
+
+static Arena arenas[ MAX_NUMA_NODES ];
+static unsigned int arena_count = 0;
+static unsigned char cpu_arena[ MAX_CPUS ]; /* Arena serving each CPU */
 static unsigned int final_basic_block_size = 0;
-static unsigned int free_list_size = 0;
-static Header** free_list = NULL;
 static unsigned short int memory_valid = 0;
+static EmergencyPool emergency_pool;
+static pthread_once_t fork_handlers_once = PTHREAD_ONCE_INIT;
+
+/* Size class tables, filled once by build_size_classes(). Class 0 is unused so
+   that class indices match free_list indices. */
+static unsigned int class_blocks[ MAX_SIZE_CLASSES ]; /* Blocks in each class */
+static unsigned char class_right[ MAX_SIZE_CLASSES ]; /* Class of the right child */
+static unsigned int class_padding[ MAX_SIZE_CLASSES ]; /* Blocks left over by a
+                                                          split, after the right child */
+static unsigned int size_class_count = 0; /* Classes in the tables, class 0 included */
+
+#if SIZE_CLASS_POLICY == SIZE_CLASS_FIBONACCI
+#define SIZE_CLASS_K 2
+#define SIZE_CLASS_PAD 0
+#define SIZE_CLASS_NAME "Fibonacci"
+#elif SIZE_CLASS_POLICY == SIZE_CLASS_LEONARDO
+#define SIZE_CLASS_K 2
+#define SIZE_CLASS_PAD 1
+#define SIZE_CLASS_NAME "Leonardo"
+#elif SIZE_CLASS_POLICY == SIZE_CLASS_GENERALIZED
+#define SIZE_CLASS_K SIZE_CLASS_ORDER
+#define SIZE_CLASS_PAD 0
+#define SIZE_CLASS_NAME "Generalized Fibonacci"
+#elif SIZE_CLASS_POLICY == SIZE_CLASS_BUDDY
+#define SIZE_CLASS_K 1
+#define SIZE_CLASS_PAD 0
+#define SIZE_CLASS_NAME "Binary buddy"
+#else
+#error "Unknown SIZE_CLASS_POLICY"
+#endif
+
+#if SIZE_CLASS_K < 1
+#error "SIZE_CLASS_ORDER must be at least 1"
+#endif
 
 
 unsigned int find_fibonacci(unsigned int _min_number,
@@ -63,44 +193,114 @@ unsigned int find_fibonacci(unsigned int _min_number,
 }
 
 
-/* Add block pointed to by _hdr to the appropriate free_list index */
-static void make_available(Header* _hdr) {
-    Header* block = NULL;
-    unsigned int free_list_index = find_fibonacci(_hdr->block_count, NULL, NULL, 1);
+/* Fill the size class tables for SIZE_CLASS_POLICY, stopping before sizes
+   overflow an unsigned int or the tables are full */
+static void build_size_classes(void) {
+    if (size_class_count > 0) {
+        return;
+    }
     
-    if (free_list[ free_list_index ] == NULL) {
-        free_list[ free_list_index ] = _hdr;
-        _hdr->prev = _hdr->next = NULL;
-    } else {
-        block = free_list[ free_list_index ];
+    class_blocks[0] = 0;
+    class_blocks[1] = 1;
+    size_class_count = 2;
+    
+    while (size_class_count < MAX_SIZE_CLASSES) {
+        unsigned int n = size_class_count;
+        unsigned int right = (n > SIZE_CLASS_K) ? n - SIZE_CLASS_K : 1;
+        unsigned long long blocks = (unsigned long long)class_blocks[ n - 1 ] +
+                                    class_blocks[ right ] + SIZE_CLASS_PAD;
+        
+        if (blocks > 0xFFFFFFFFull) {
+            break;
+        }
+        
+        class_blocks[ n ] = (unsigned int)blocks;
+        class_right[ n ] = (unsigned char)right;
+        class_padding[ n ] = SIZE_CLASS_PAD;
+        ++size_class_count;
+    }
+}
+
+
+/* Smallest size class holding at least _blocks basic blocks, 0 if none does */
+static unsigned int size_class_for(unsigned int _blocks) {
+    unsigned int low = 1;
+    unsigned int high = size_class_count;
+    
+    while (low < high) {
+        unsigned int middle = (low + high) / 2;
         
-        while (block->next != NULL) {
-            block = block->next;
+        if (class_blocks[ middle ] < _blocks) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
+    }
+    
+    return (low < size_class_count) ? low : 0;
+}
+
+
+/* Number of basic blocks needed to hold _length bytes plus the block's Header,
+   before rounding up to a size class */
+static unsigned int blocks_for_length(unsigned int _length) {
+    unsigned int blocks = 0;
+    
+    if (_length < (final_basic_block_size - sizeof(Header))) { /* 1 block needed */
+        blocks = 1;
+    } else if (_length < final_basic_block_size) {  /* Need for 2 blocks */
+        blocks = 2;
+    } else {    /* Need for more than 2 blocks */
+        blocks = (_length + sizeof(Header)) / final_basic_block_size;
         
-        block->next = _hdr;
-        _hdr->prev = block;
-        _hdr->next = NULL;
+        if ((_length + sizeof(Header)) % final_basic_block_size > 0) {
+            ++blocks;
+        }
+    }
+    
+    return blocks;
+}
+
+
+/* Add block pointed to by _hdr to the front of free_list[ _free_list_index ], the
+   index must match the block's size_class. Pushing at the front keeps this O(1)
+   and hands out the most recently freed, cache-warm block first. */
+static void make_available_at(Arena* _arena, Header* _hdr, unsigned int _free_list_index) {
+    Header* block = _arena->free_list[ _free_list_index ];
+    
+    _hdr->prev = NULL;
+    _hdr->next = block;
+    
+    if (block != NULL) {
+        block->prev = _hdr;
     }
     
+    _arena->free_list[ _free_list_index ] = _hdr;
+    
     _hdr->is_free = 'Y';
 }
 
 
+/* Add block pointed to by _hdr to the appropriate free_list index */
+static void make_available(Arena* _arena, Header* _hdr) {
+    make_available_at(_arena, _hdr, _hdr->size_class);
+}
+
+
 /* Remove block pointed to by _hdr from associated free_list index. Should always
    be used in conjunction with add_to_allocation_queue() */
-static void make_unavailable(Header* _hdr) {
-    unsigned int free_list_index = find_fibonacci(_hdr->block_count, NULL, NULL, 1);
+static void make_unavailable(Arena* _arena, Header* _hdr) {
+    unsigned int free_list_index = _hdr->size_class;
     
     if (_hdr->next == NULL) {
         if (_hdr->prev == NULL) {
-            free_list[ free_list_index ] = NULL;
+            _arena->free_list[ free_list_index ] = NULL;
         } else {
             _hdr->prev->next = NULL;
         }
     } else {
         if (_hdr->prev == NULL) {
-            free_list[ free_list_index ] = _hdr->next;
+            _arena->free_list[ free_list_index ] = _hdr->next;
             _hdr->next->prev = NULL;
         } else {
             _hdr->prev->next = _hdr->next;
@@ -114,34 +314,30 @@ static void make_unavailable(Header* _hdr) {
 }
 
 
-/* Add block pointed to by _hdr to allocation queue, a.k.a, free_list[0] */
-static void add_to_allocation_queue(Header* _hdr) {
+/* Add block pointed to by _hdr to the front of the allocation queue, a.k.a,
+   free_list[0] */
+static void add_to_allocation_queue(Arena* _arena, Header* _hdr) {
+    Header* block = _arena->free_list[0];
     
-    if (free_list[0] == NULL) {
-        free_list[0] = _hdr;
-        _hdr->prev = _hdr->next = NULL;
-    } else {
-        Header* block = free_list[0];
-        
-        while (block->next != NULL) {
-            block = block->next;
-        }
-        
-        block->next = _hdr;
-        _hdr->prev = block;
-        _hdr->next = NULL;
+    _hdr->prev = NULL;
+    _hdr->next = block;
+    
+    if (block != NULL) {
+        block->prev = _hdr;
     }
+    
+    _arena->free_list[0] = _hdr;
 }
 
 
 /* Remove block pointed to by _hdr from allocation queue, a.k.a, free_list[0]. 
    Should always be used in conjunction with make_available() */
-static void remove_from_allocation_queue(Header* _hdr) {
+static void remove_from_allocation_queue(Arena* _arena, Header* _hdr) {
     if (_hdr->prev == NULL) {
         if (_hdr->next == NULL) {
-            free_list[ 0 ] = NULL;
+            _arena->free_list[ 0 ] = NULL;
         } else {
-            free_list[ 0 ] = _hdr->next;
+            _arena->free_list[ 0 ] = _hdr->next;
             _hdr->next->prev = NULL;
         }
     } else {
@@ -157,96 +353,246 @@ static void remove_from_allocation_queue(Header* _hdr) {
 }
 
 
-/* Split block pointed to by _hdr into constituent buddy blocks and depending on
-   _get_right_child set _child pointer to the newly created right/left child of split. */
-static void split(Header* _hdr, Header* _child, unsigned short int _get_right_child) {
-    unsigned int n1 = 0;
-    unsigned int n2 = 0;
-    unsigned int free_list_index = find_fibonacci(_hdr->block_count, &n1, &n2, 1);
+/* Split the free block pointed to by _hdr into constituent buddy blocks: a left
+   child one class down, a right child of class class_right[], and a padding block
+   after it if the policy leaves one. Both children are made available. */
+static void split(Arena* _arena, Header* _hdr) {
+    unsigned int parent_class = _hdr->size_class;
+    unsigned int left_class = parent_class - 1;
+    unsigned int right_class = class_right[ parent_class ];
     
-    Header* parent = free_list[ free_list_index ];
-    make_unavailable(parent);
+    Header* parent = _hdr;
+    make_unavailable(_arena, parent);
     
     void* left_child = parent;
-    void* right_child = (char*)left_child + (n2 * final_basic_block_size);
+    void* right_child = (char*)left_child + (class_blocks[ left_class ] * final_basic_block_size);
     
     /* These parameters need to be set before any others so that proper values are 
        not overwritten */
     ((Header*)right_child)->inherit = parent->inherit;
     ((Header*)left_child)->inherit = parent->child;
+    ((Header*)right_child)->parent_class = parent_class;
+    ((Header*)right_child)->is_zero = parent->is_zero;
     
     /* Left child will always be the larger block, and its inheritance bit is set
        to the child, i.e. left/right, bit of the parent */
-    ((Header*)left_child)->block_count = n2;
+    ((Header*)left_child)->block_count = class_blocks[ left_class ];
+    ((Header*)left_child)->size_class = left_class;
     ((Header*)left_child)->child = 'L';
     ((Header*)left_child)->header_ident = HEADER_IDENT;
     
-    make_available((Header*)left_child);
+    make_available(_arena, (Header*)left_child);
     
     /* Right child's inheritance bit is set to the inheritance bit of the parent */
-    ((Header*)right_child)->block_count = n1;
+    ((Header*)right_child)->block_count = class_blocks[ right_class ];
+    ((Header*)right_child)->size_class = right_class;
     ((Header*)right_child)->child = 'R';
     ((Header*)right_child)->header_ident = HEADER_IDENT;
     
-    make_available((Header*)right_child);
+    make_available(_arena, (Header*)right_child);
+    
+    /* Padding is never allocated, it only keeps the arena walkable by block_count */
+    if (class_padding[ parent_class ] > 0) {
+        Header* padding = (Header*)((char*)right_child +
+                                    (class_blocks[ right_class ] * final_basic_block_size));
+        
+        padding->header_ident = HEADER_IDENT;
+        padding->block_count = class_padding[ parent_class ];
+        padding->size_class = 0;
+        padding->parent_class = 0;
+        padding->child = '-';
+        padding->inherit = '-';
+        padding->is_free = 'P';
+        padding->is_zero = parent->is_zero;
+        padding->prev = padding->next = NULL;
+    }
+    
+    ++_arena->split_count;
+}
+
+
+/* Clear _length bytes at _addr, with non-temporal stores for large ranges */
+static void zero_memory(void* _addr, size_t _length) {
+#ifdef __SSE2__
+    if (_length >= MY_MALLOC_STREAM_THRESHOLD) {
+        char* start = (char*)_addr;
+        char* end = start + _length;
+        char* aligned_start = (char*)(((size_t)start + 15) & ~(size_t)15);
+        char* aligned_end = (char*)((size_t)end & ~(size_t)15);
+        __m128i zero = _mm_setzero_si128();
+        
+        memset(start, 0, aligned_start - start);
+        
+        for (char* line = aligned_start; line < aligned_end; line += 16) {
+            _mm_stream_si128((__m128i*)line, zero);
+        }
+        
+        _mm_sfence();
+        memset(aligned_end, 0, end - aligned_end);
+        return;
+    }
+#endif
+    
+    memset(_addr, 0, _length);
+}
+
+
+/* Return the pages of a large free block of _arena to the kernel. They read back
+   as zero, so after clearing the partial pages at either end the block is known
+   zero. 'is_zero' is only set on success, and left alone when the block spans no
+   whole page. */
+static void discard_block(Arena* _arena, Header* _hdr) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    char* contents = (char*)_hdr + sizeof(Header);
+    char* end = (char*)_hdr + ((size_t)_hdr->block_count * final_basic_block_size);
+    char* page_start = (char*)(((size_t)contents + page_size - 1) & ~(page_size - 1));
+    char* page_end = (char*)((size_t)end & ~(page_size - 1));
+    
+    if (page_start >= page_end) {
+        return;
+    }
+    
+    memset(contents, 0, page_start - contents);
+    memset(page_end, 0, end - page_end);
+    
+    /* MADV_DONTNEED on a private file mapping reads the image back in, so
+       restored arenas get fresh anonymous pages over the range instead. Those
+       follow the default NUMA policy, first touch places them. */
+    if (_arena->image_backed) {
+        if (mmap(page_start, page_end - page_start, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            _hdr->is_zero = 'Y';
+        }
+    } else if (madvise(page_start, page_end - page_start, MADV_DONTNEED) == 0) {
+        _hdr->is_zero = 'Y';
+    }
+}
+
+
+/* Make the contents of the free block pointed to by _hdr known zero */
+static void scrub_block(Arena* _arena, Header* _hdr) {
+    if ((size_t)_hdr->block_count * final_basic_block_size >= MY_MALLOC_DONTNEED_THRESHOLD) {
+        discard_block(_arena, _hdr);
+    }
+    
+    if (_hdr->is_zero != 'Y') {
+        zero_memory((char*)_hdr + sizeof(Header),
+                    (size_t)_hdr->block_count * final_basic_block_size - sizeof(Header));
+        _hdr->is_zero = 'Y';
+    }
+}
+
+
+/* Zero state of the block of class _parent_class formed by merging buddies _left
+   and _right. When both are zero, the right child's Header and any padding Header
+   become part of the merged block's contents, so they are cleared to keep it
+   known zero. Must be called once the right child's Header is no longer needed. */
+static char merged_is_zero(Arena* _arena, Header* _left, Header* _right,
+                           unsigned int _parent_class) {
+    Header* padding = NULL;
+    
+    /* A right child is never larger than its left sibling, so a dirty one is
+       scrubbed rather than losing the larger zero region next to it */
+    if (_left->is_zero == 'Y' && _right->is_zero != 'Y') {
+        scrub_block(_arena, _right);
+    }
+    
+    if (_left->is_zero != 'Y' || _right->is_zero != 'Y') {
+        return 'N';
+    }
+    
+    if (class_padding[ _parent_class ] > 0) {
+        padding = (Header*)((char*)_right + (class_blocks[ class_right[ _parent_class ] ] *
+                                             final_basic_block_size));
+        
+        if (padding->is_zero != 'Y') {
+            memset(padding, 0, class_padding[ _parent_class ] * final_basic_block_size);
+        } else {
+            memset(padding, 0, sizeof(Header));
+        }
+    }
+    
+    memset(_right, 0, sizeof(Header));
+    
+    return 'Y';
+}
+
+
+/* Address of the buddy of the block pointed to by _hdr, of class _size_class,
+   NULL for the root block */
+static Header* buddy_of(Header* _hdr, unsigned int _size_class) {
+    if (_hdr->child == 'L') {
+        return (Header*)((char*)_hdr + (class_blocks[ _size_class ] * final_basic_block_size));
+    } else if (_hdr->child == 'R') {
+        return (Header*)((char*)_hdr - (class_blocks[ _hdr->parent_class - 1 ] *
+                                        final_basic_block_size));
+    }
     
-    _child = (Header*)(_get_right_child ? right_child : left_child);
+    return NULL;
 }
 
 
-/* Attempt to combine the block pointed to by _hdr with its respective buddy, 
-   returns 1 if another immediate coalesce is possible, 0 otherwise. */
-static int coalesce(Header** _hdr) {
+/* Attempt to combine the free block pointed to by _hdr, of class *_size_class,
+   which must not be on a free list, with its respective buddy. The merged block
+   is left off the free lists too, so a chain of merges only unlinks buddies, and
+   *_size_class is updated to its class. Returns 1 if another immediate coalesce
+   is possible, 0 otherwise. */
+static int coalesce(Arena* _arena, Header** _hdr, unsigned int* _size_class) {
     if ((*_hdr)->child == 'L') {
-        unsigned int n1 = 0;
-        unsigned int n2 = 0;
-        void* right_child = (char*)(*_hdr) + ((*_hdr)->block_count * final_basic_block_size);
+        unsigned int parent_class = *_size_class + 1;
+        void* right_child = (char*)(*_hdr) + (class_blocks[ *_size_class ] *
+                                              final_basic_block_size);
         
-        if (((Header*)right_child)->header_ident != HEADER_IDENT) {
+        if (unlikely(((Header*)right_child)->header_ident != HEADER_IDENT)) {
             return 0;
         }
         
-        find_fibonacci((*_hdr)->block_count, &n1, &n2, 0);
-        
-        if ((((Header*)right_child)->block_count == n2) && ((Header*)right_child)->is_free == 'Y') {
-            make_unavailable(*_hdr);
-            make_unavailable((Header*)right_child);
+        if ((((Header*)right_child)->size_class == class_right[ parent_class ]) &&
+                ((Header*)right_child)->child == 'R' &&
+                ((Header*)right_child)->is_free == 'Y') {
+            make_unavailable(_arena, (Header*)right_child);
             
-            (*_hdr)->block_count += ((Header*)right_child)->block_count;
+            (*_hdr)->block_count = class_blocks[ parent_class ];
+            (*_hdr)->size_class = parent_class;
             (*_hdr)->child = (*_hdr)->inherit;
             (*_hdr)->header_ident = HEADER_IDENT;
             (*_hdr)->inherit = ((Header*)right_child)->inherit;
             
-            make_available(*_hdr);
+            /* The next level's buddy is known now, start loading it */
+            prefetch_for_write(buddy_of(*_hdr, parent_class));
+            
+            (*_hdr)->is_zero = merged_is_zero(_arena, *_hdr, (Header*)right_child,
+                                              parent_class);
         } else {
             return 0;
         }
         
     } else if ((*_hdr)->child == 'R') {
-        unsigned int n1 = 0;
-        unsigned int n2 = 0;
+        unsigned int parent_class = (*_hdr)->parent_class;
         
-        find_fibonacci((*_hdr)->block_count, &n1, &n2, 0);
+        void* left_child = (char*)(*_hdr) - (class_blocks[ parent_class - 1 ] * final_basic_block_size);
         
-        void* left_child = (char*)(*_hdr) - (((*_hdr)->block_count + n2) * final_basic_block_size);
-        
-        if (((Header*)left_child)->header_ident != HEADER_IDENT) {
+        if (unlikely(((Header*)left_child)->header_ident != HEADER_IDENT)) {
             return 0;
         }
         
-        if ((((Header*)left_child)->block_count == ((*_hdr)->block_count + n2)) &&
+        if ((((Header*)left_child)->size_class == parent_class - 1) &&
+                ((Header*)left_child)->child == 'L' &&
                 ((Header*)left_child)->is_free == 'Y') {
-            make_unavailable(*_hdr);
-            make_unavailable((Header*)left_child);
+            make_unavailable(_arena, (Header*)left_child);
             
-            ((Header*)left_child)->block_count += (*_hdr)->block_count;
+            ((Header*)left_child)->block_count = class_blocks[ parent_class ];
+            ((Header*)left_child)->size_class = parent_class;
             ((Header*)left_child)->child = ((Header*)left_child)->inherit;
             ((Header*)left_child)->header_ident = HEADER_IDENT;
             ((Header*)left_child)->inherit = (*_hdr)->inherit;
             
-            *_hdr = ((Header*)left_child);
+            prefetch_for_write(buddy_of((Header*)left_child, parent_class));
             
-            make_available(*_hdr);
+            ((Header*)left_child)->is_zero = merged_is_zero(_arena, (Header*)left_child,
+                                                            *_hdr, parent_class);
+            
+            *_hdr = ((Header*)left_child);
         } else {
             return 0;
         }
@@ -254,14 +600,141 @@ static int coalesce(Header** _hdr) {
         return 0;
     }
     
+    *_size_class = (*_hdr)->size_class;
+    ++_arena->coalesce_count;
+    
     return 1;
 }
 
 
-unsigned int init_allocator(unsigned int _basic_block_size, unsigned int _length) {
-    unsigned int allocation_size = 0;
-    unsigned int number_of_blocks = 0;
-    unsigned int initial_block_amt = 0;
+/* Parse a Linux cpulist/nodelist such as "0-3,8-11" read from _path, calling
+   _visit for every number in it. Returns the number of entries visited. */
+static unsigned int parse_list(const char* _path, void (*_visit)(unsigned int, void*),
+                               void* _context) {
+    char buffer[ 4096 ];
+    char* position = buffer;
+    unsigned int visited = 0;
+    FILE* file = fopen(_path, "r");
+    
+    if (file == NULL) {
+        return 0;
+    }
+    
+    if (fgets(buffer, sizeof(buffer), file) == NULL) {
+        buffer[0] = '\0';
+    }
+    fclose(file);
+    
+    while (*position >= '0' && *position <= '9') {
+        unsigned long first = strtoul(position, &position, 10);
+        unsigned long last = first;
+        
+        if (*position == '-') {
+            last = strtoul(position + 1, &position, 10);
+        }
+        
+        for (unsigned long i = first; i <= last && i < MAX_CPUS; i++) {
+            _visit((unsigned int)i, _context);
+            ++visited;
+        }
+        
+        if (*position == ',') {
+            ++position;
+        }
+    }
+    
+    return visited;
+}
+
+
+static void collect_node(unsigned int _node, void* _nodes) {
+    unsigned int* nodes = (unsigned int*)_nodes;
+    
+    if (nodes[0] < MAX_NUMA_NODES) {
+        nodes[ ++nodes[0] ] = _node;
+    }
+}
+
+
+static void assign_cpu(unsigned int _cpu, void* _arena_index) {
+    if (_cpu < MAX_CPUS) {
+        cpu_arena[ _cpu ] = (unsigned char)*(unsigned int*)_arena_index;
+    }
+}
+
+
+/* Bind the memory of _arena to its node before it is first touched, so that
+   every page faults in node-local. Best effort, the arena stays usable unbound. */
+static void bind_arena(Arena* _arena) {
+#if defined(__linux__) && defined(SYS_mbind)
+    /* Node ids can be sparse, parse_list() keeps them below MAX_CPUS */
+    unsigned long node_mask[ MAX_CPUS / (8 * sizeof(unsigned long)) ] = { 0 };
+    
+    if (_arena->node < 0 || _arena->node >= MAX_CPUS) {
+        _arena->node = -1;
+        return;
+    }
+    
+    node_mask[ _arena->node / (8 * sizeof(unsigned long)) ] |=
+        1ul << (_arena->node % (8 * sizeof(unsigned long)));
+    
+    if (syscall(SYS_mbind, _arena->allocated_memory_front, (unsigned long)_arena->final_allocation_size,
+                MPOL_BIND, node_mask, sizeof(node_mask) * 8 + 1, 0) != 0) {
+        printf("\n!--- FAIL (init_numa_allocator): Cannot bind memory to node %i. ---!\n",
+               _arena->node);
+        _arena->node = -1;
+    }
+#else
+    _arena->node = -1;
+#endif
+}
+
+
+/* Arena serving the calling thread: the one of the NUMA node it runs on */
+static Arena* local_arena(void) {
+    int cpu = 0;
+    
+    if (arena_count <= 1) {
+        return &arenas[0];
+    }
+    
+    cpu = sched_getcpu();
+    
+    return &arenas[ (cpu >= 0 && cpu < MAX_CPUS) ? cpu_arena[ cpu ] : 0 ];
+}
+
+
+/* Whether _addr lies in the emergency pool's slots, async-signal-safe */
+static int emergency_owns(Addr _addr) {
+    char* slots = __atomic_load_n(&emergency_pool.slots, __ATOMIC_ACQUIRE);
+    
+    return slots != NULL && (char*)_addr >= slots &&
+           (char*)_addr < slots + (size_t)emergency_pool.slot_size * emergency_pool.slot_count;
+}
+
+
+/* Arena whose memory holds _addr, NULL if none does */
+static Arena* owning_arena(Addr _addr) {
+    for (unsigned int i = 0; i < arena_count; i++) {
+        if ((char*)_addr >= (char*)arenas[i].allocated_memory_front &&
+                (char*)_addr < (char*)arenas[i].allocated_memory_back) {
+            return &arenas[i];
+        }
+    }
+    
+    return NULL;
+}
+
+
+static void register_fork_handlers(void) {
+    pthread_atfork(allocator_fork_prepare, allocator_fork_parent, allocator_fork_child);
+}
+
+
+/* Set the basic block size shared by every arena */
+static void set_basic_block_size(unsigned int _basic_block_size) {
+    pthread_once(&fork_handlers_once, register_fork_handlers);
+    build_size_classes();
     
     /* basic_block_size should not be smaller than sizeof(Header) */
     if (_basic_block_size < sizeof(Header)) {
@@ -269,6 +742,16 @@ unsigned int init_allocator(unsigned int _basic_block_size, unsigned int _length
     } else {
         final_basic_block_size = _basic_block_size;
     }
+}
+
+
+/* Map _length bytes for _arena, bound to _arena->node unless it is -1, and put
+   all of it in one free block. Returns the memory made available, 0 on error. */
+static unsigned int init_arena(Arena* _arena, unsigned int _length) {
+    unsigned int allocation_size = 0;
+    unsigned int number_of_blocks = 0;
+    unsigned int initial_block_amt = 0;
+    unsigned int initial_class = 0;
     
     /* Make sure there is enough space for the memory management 'Header' */
     allocation_size = _length + sizeof(Header);
@@ -279,216 +762,408 @@ unsigned int init_allocator(unsigned int _basic_block_size, unsigned int _length
                             (allocation_size % final_basic_block_size);
     }
     
-    /* Make allocation a multiple of a basic_block_size */
+    /* Make allocation a multiple of a basic_block_size, rounded up to a size class */
     number_of_blocks = allocation_size / final_basic_block_size;
-    final_allocation_size = final_basic_block_size *
-                                find_fibonacci(number_of_blocks, NULL, NULL, 0);
-    number_of_blocks = final_allocation_size / final_basic_block_size;
+    initial_class = size_class_for(number_of_blocks);
+    
+    if (initial_class == 0 || (unsigned long long)class_blocks[ initial_class ] *
+            final_basic_block_size > 0xFFFFFFFFull) {
+        printf("\n!--- FAIL (init_allocator): Requested memory is too large. ---!\n");
+        goto error;
+    }
+    
+    initial_block_amt = class_blocks[ initial_class ];
+    _arena->final_allocation_size = final_basic_block_size * initial_block_amt;
+    number_of_blocks = initial_block_amt;
+    
+    /* Anonymous mappings arrive zero-filled, so the whole arena starts known zero */
+    _arena->allocated_memory_front = mmap(NULL, _arena->final_allocation_size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (_arena->allocated_memory_front == MAP_FAILED) {
+        _arena->allocated_memory_front = NULL;
+        printf("\n!--- FAIL (init_allocator): Cannot map memory. ---!\n");
+        goto error;
+    }
+    _arena->allocated_memory_back = (char*)_arena->allocated_memory_front + _arena->final_allocation_size;
     
-    allocated_memory_front = malloc(final_allocation_size);
-    allocated_memory_back = (char*)allocated_memory_front + final_allocation_size;
+    if (_arena->node >= 0) {
+        bind_arena(_arena);
+        printf("\nNUMA node: %i", _arena->node);
+    }
     
     printf("\nRequested memory: %i bytes\nAllocated memory: %u bytes",
-           _length, final_allocation_size);
+           _length, _arena->final_allocation_size);
     printf("\nAvailable memory: %lu bytes",
-           final_allocation_size - sizeof(Header));
+           _arena->final_allocation_size - sizeof(Header));
     
-    printf("\n\n#Blocks: %i\nFib Index: %u", number_of_blocks,
-           find_fibonacci(number_of_blocks, NULL, NULL, 1));
+    printf("\n\n#Blocks: %i\nSize classes: %s\nClass Index: %u", number_of_blocks,
+           SIZE_CLASS_NAME, initial_class);
     
     /* Intializing freeList, add 1 extra list element to hold allocated 
        blocks: free_list[0] */
-    free_list_size = find_fibonacci(number_of_blocks, NULL, NULL, 1) + 1;
-    initial_block_amt = find_fibonacci(number_of_blocks, NULL, NULL, 0);
+    _arena->free_list_size = initial_class + 1;
     
-    printf("\nfree_list_size: %u", free_list_size);
+    printf("\nfree_list_size: %u", _arena->free_list_size);
     
-    free_list = (Header**) malloc(free_list_size * sizeof(Header*));
+    _arena->free_list = (Header**) malloc(_arena->free_list_size * sizeof(Header*));
     
-    free_list[ free_list_size - 1 ] = (Header*) allocated_memory_front;
-    free_list[ free_list_size - 1 ]->prev = NULL;
-    free_list[ free_list_size - 1 ]->next = NULL;
-    free_list[ free_list_size - 1 ]->header_ident = HEADER_IDENT;
-    free_list[ free_list_size - 1 ]->block_count = initial_block_amt;
-    free_list[ free_list_size - 1 ]->child = '-';
-    free_list[ free_list_size - 1 ]->inherit = '-';
-    free_list[ free_list_size - 1 ]->is_free = 'Y';
+    _arena->free_list[ _arena->free_list_size - 1 ] = (Header*) _arena->allocated_memory_front;
+    _arena->free_list[ _arena->free_list_size - 1 ]->prev = NULL;
+    _arena->free_list[ _arena->free_list_size - 1 ]->next = NULL;
+    _arena->free_list[ _arena->free_list_size - 1 ]->header_ident = HEADER_IDENT;
+    _arena->free_list[ _arena->free_list_size - 1 ]->block_count = initial_block_amt;
+    _arena->free_list[ _arena->free_list_size - 1 ]->size_class = initial_class;
+    _arena->free_list[ _arena->free_list_size - 1 ]->parent_class = 0;
+    _arena->free_list[ _arena->free_list_size - 1 ]->child = '-';
+    _arena->free_list[ _arena->free_list_size - 1 ]->inherit = '-';
+    _arena->free_list[ _arena->free_list_size - 1 ]->is_free = 'Y';
+    _arena->free_list[ _arena->free_list_size - 1 ]->is_zero = 'Y';
     
-    for (int i = free_list_size - 2; i >= 0; i--) {
-        free_list[i] = NULL;
+    for (int i = _arena->free_list_size - 2; i >= 0; i--) {
+        _arena->free_list[i] = NULL;
     }
     
-    memory_valid = 1; /* Allow allocations */
+    _arena->split_count = _arena->coalesce_count = 0;
+    _arena->image_backed = 0;
+    pthread_mutex_init(&_arena->lock, NULL);
     
     printf("\n\n%i bytes have been allocated for use, and free_list initialized.",
-           final_allocation_size);
+           _arena->final_allocation_size);
     
     printf("\nThe free-list has a pointer to %u free allocated bytes",
-           free_list[ free_list_size - 1 ]->block_count *
+           _arena->free_list[ _arena->free_list_size - 1 ]->block_count *
                                                 final_basic_block_size);
     
     printf("\nMemory and allocator initialized successfully.\n\n");
     
-    return final_allocation_size;
+    return _arena->final_allocation_size;
     
 error:
-    return -1;
+    return 0;
 }
 
 
-int release_allocator() {
-    free(free_list);
-    free_list_size = 0;
-    free(allocated_memory_front);
-    allocated_memory_front = allocated_memory_back = NULL;
-    final_allocation_size = 0;
-    final_basic_block_size = 0;
+/* Return the memory of _arena to the operating system */
+static void release_arena(Arena* _arena) {
+    free(_arena->free_list);
+    _arena->free_list = NULL;
+    _arena->free_list_size = 0;
+    munmap(_arena->allocated_memory_front, _arena->final_allocation_size);
+    _arena->allocated_memory_front = _arena->allocated_memory_back = NULL;
+    _arena->final_allocation_size = 0;
+    pthread_mutex_destroy(&_arena->lock);
+}
+
+
+unsigned int init_allocator(unsigned int _basic_block_size, unsigned int _length) {
+    unsigned int allocation_size = 0;
     
-    memory_valid = 0; /* Disallow allocations */
+    set_basic_block_size(_basic_block_size);
+    memset(cpu_arena, 0, sizeof(cpu_arena));
     
-    printf("\nMemory released and allocator uninitialized successfully.");
+    arenas[0].node = -1;
+    allocation_size = init_arena(&arenas[0], _length);
     
-    return 0;
+    if (allocation_size == 0) {
+        return 0;
+    }
     
-error:
-    printf("\n!--- FAIL (release_alocator): Problem releasing memory/allocator. ---!\n");
-    return -1;
+    arena_count = 1;
+    memory_valid = 1; /* Allow allocations */
+    
+    return allocation_size;
 }
 
 
-extern Addr my_malloc(unsigned int _length) {
-    if (!memory_valid) {
-        return 0;
+unsigned int init_numa_allocator(unsigned int _basic_block_size, unsigned int _length) {
+    unsigned int nodes[ MAX_NUMA_NODES + 1 ] = { 0 }; /* nodes[0] holds the count */
+    unsigned long long total_size = 0;
+    char path[ 64 ];
+    
+    parse_list("/sys/devices/system/node/online", collect_node, nodes);
+    
+    /* No NUMA, or a single node: one arena, exactly as init_allocator() */
+    if (nodes[0] <= 1) {
+        return init_allocator(_basic_block_size, _length);
     }
     
-    Addr return_address = NULL;
-    Header* hdr = NULL;
-    unsigned int blocks_to_allocate = 0;
-    unsigned int free_list_index = 0;
-    int temp = 0;
+    set_basic_block_size(_basic_block_size);
+    memset(cpu_arena, 0, sizeof(cpu_arena));
     
-    if (_length < (final_basic_block_size - sizeof(Header))) { /* 1 block needed */
-        blocks_to_allocate = 1;
-    } else if (_length < final_basic_block_size) {  /* Need for 2 blocks */
-        blocks_to_allocate = 2;
-    } else {    /* Need for more than 2 blocks */
-        blocks_to_allocate = (_length + sizeof(Header)) / final_basic_block_size;
+    for (unsigned int i = 0; i < nodes[0]; i++) {
+        unsigned int allocation_size = 0;
         
-        if ((_length + sizeof(Header)) % final_basic_block_size > 0) {
-            ++blocks_to_allocate;
+        arenas[i].node = (int)nodes[ i + 1 ];
+        allocation_size = init_arena(&arenas[i], _length);
+        
+        if (allocation_size == 0) {
+            while (i-- > 0) {
+                release_arena(&arenas[i]);
+            }
+            return 0;
         }
         
-        blocks_to_allocate = find_fibonacci(blocks_to_allocate, NULL, NULL, 0);
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", nodes[ i + 1 ]);
+        parse_list(path, assign_cpu, &i);
+        
+        total_size += allocation_size;
     }
     
-    free_list_index = find_fibonacci(blocks_to_allocate, NULL, NULL, 1);
-    temp = (int)free_list_index;
+    arena_count = nodes[0];
+    memory_valid = 1; /* Allow allocations */
     
-    /* Locate smallest, appropriate, and available block of memory to serve request */
-    while (temp < free_list_size) {
-        if ( free_list[ temp ] == NULL ) {
-            ++temp;
-        } else {
-            break;
-        }
+    return total_size > 0xFFFFFFFFull ? 0xFFFFFFFFu : (unsigned int)total_size;
+}
+
+
+unsigned int allocator_arena_count(void) {
+    return memory_valid ? arena_count : 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* FORK HANDLERS */
+/*--------------------------------------------------------------------------*/
+
+/* Arena locks are always taken one at a time, so taking all of them in index
+   order cannot deadlock against my_malloc()/my_free() */
+void allocator_fork_prepare(void) {
+    for (unsigned int i = 0; i < arena_count; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+
+void allocator_fork_parent(void) {
+    for (unsigned int i = arena_count; i-- > 0; ) {
+        pthread_mutex_unlock(&arenas[i].lock);
     }
+}
+
+
+/* The child runs one thread, which took the locks in the parent. They are made
+   fresh rather than unlocked, which also covers forks that skipped the prepare
+   handler. */
+void allocator_fork_child(void) {
+    for (unsigned int i = 0; i < arena_count; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+}
+
+
+int release_allocator() {
+    memory_valid = 0; /* Disallow allocations */
     
-    if (temp >= free_list_size) { /* Not enough memory available */
-        printf("\n!--- FAIL (my_malloc): Not enough memory available. ---!\n");
-        return 0;
+    for (unsigned int i = 0; i < arena_count; i++) {
+        release_arena(&arenas[i]);
     }
     
-    temp = temp - free_list_index;
+    arena_count = 0;
+    final_basic_block_size = 0;
     
-    switch (temp) {
-        case 0: /* Block of appropriate size available */
-            if (free_list[ free_list_index ]->header_ident != HEADER_IDENT) {
-                printf("\n!--- FAIL (my_malloc): Invalid block access. ---!\n");
-                return 0;
-            }
-            
-            return_address = (char*)free_list[ free_list_index ] + sizeof(Header);
-            
-            /* Remove block from current position and place block at end of
-               free_list[0] queue */
-            hdr = free_list[ free_list_index ];
-            make_unavailable(hdr);
-            add_to_allocation_queue(hdr);
-            
-            /* For testing purposes */
-            //show_free_list();
-            
-            return return_address;
-            
-            break;
-            
-        default: /* Split larger block into appropriately sized one to serve request */
-        {
-            div_t division = div(temp, 2);
-            Header* child = NULL;
-            unsigned short int quit_loop = 0;
-            
-            while ((free_list[ free_list_index ] == NULL) && !quit_loop) {
-                if (division.quot >= 1) {
-                    split(free_list[ free_list_index + temp ], child, 1);
-                    temp -= 2;
-                } /*else if (division.quot == 1) {
-                    if (division.rem == 1) {
-                        split(free_list[ free_list_index + temp ], child, 0);
-                        break;
-                    } else {
-                        split(free_list[ free_list_index + temp ], child, 1);
-                        break;
-                    }
-                }*/ else if ((division.quot) < 1) {
-                    switch (division.rem) {
-                        case 0:
-                            split(free_list[ free_list_index + temp ], child, 1);
-                            quit_loop = 1;
-                            break;
-                        case 1:
-                            split(free_list[ free_list_index + temp ], child, 0);
-                            quit_loop = 1;
-                            break;
-                        default:
-                            printf("\n!--- FAIL (my_malloc): Something went very wrong here. ---!\n");
-                            return 0;
-                            break;
-                    }
-                }
-                
-                --division.quot;
+    printf("\nMemory released and allocator uninitialized successfully.");
+    
+    return 0;
+    
+error:
+    printf("\n!--- FAIL (release_alocator): Problem releasing memory/allocator. ---!\n");
+    return -1;
+}
+
+
+/* Serve a request of _length bytes from _arena, whose lock must be held. Returns
+   0 when the arena cannot serve it. */
+static Addr allocate(Arena* _arena, unsigned int _length) {
+    Addr return_address = NULL;
+    Header* hdr = NULL;
+    unsigned int free_list_index = 0;
+    unsigned int temp = 0;
+    
+    free_list_index = size_class_for(blocks_for_length(_length));
+    if (unlikely(free_list_index == 0 || free_list_index >= _arena->free_list_size)) {
+        return 0; /* Larger than any block of the arena */
+    }
+    
+    hdr = _arena->free_list[ free_list_index ];
+    
+    /* Block of appropriate size available is the common case, otherwise split */
+    if (unlikely(hdr == NULL)) {
+        temp = free_list_index;
+        
+        /* Locate smallest, appropriate, and available block of memory to serve request */
+        while (temp < _arena->free_list_size) {
+            if ( _arena->free_list[ temp ] == NULL ) {
+                ++temp;
+            } else {
+                break;
             }
+        }
+        
+        if (temp >= _arena->free_list_size) { /* Not enough memory available */
+            return 0;
+        }
+        
+        /* Split larger blocks until one of the requested class is available. Each
+           split leaves a left child one class down, so the smallest free class above
+           the request keeps shrinking until it reaches it. The rescan only runs while
+           the requested class is still empty and stops at the end of free_list, as
+           the block just split may have been the last one above the request. */
+        while (_arena->free_list[ free_list_index ] == NULL) {
+            split(_arena, _arena->free_list[ temp ]);
             
-            return_address = (char*)free_list[ free_list_index ] + sizeof(Header);
-            
-            /* Remove block from current position and place block at end of
-               free_list[0] queue */
-            hdr = free_list[ free_list_index ];
-            make_unavailable(hdr);
-            add_to_allocation_queue(hdr);
+            if (_arena->free_list[ free_list_index ] != NULL) {
+                break;
+            }
             
-            /* For testing purposes */
-            //show_free_list();
+            temp = free_list_index + 1;
+            while (temp < _arena->free_list_size && _arena->free_list[ temp ] == NULL) {
+                ++temp;
+            }
             
-            return return_address;
+            if (unlikely(temp >= _arena->free_list_size)) {
+                printf("\n!--- FAIL (my_malloc): Split left no block to serve request. ---!\n");
+                return 0;
+            }
+        }
+        
+        hdr = _arena->free_list[ free_list_index ];
+    }
+    
+    if (unlikely(hdr->header_ident != HEADER_IDENT)) {
+        printf("\n!--- FAIL (my_malloc): Invalid block access. ---!\n");
+        return 0;
+    }
+    
+    return_address = (char*)hdr + sizeof(Header);
+    
+    /* Remove block from current position and place block at the front of
+       free_list[0] queue */
+    make_unavailable(_arena, hdr);
+    add_to_allocation_queue(_arena, hdr);
+    
+    /* For testing purposes */
+    //show_free_list();
+    
+    return return_address;
+}
 
-            break;
+
+extern Addr my_malloc(unsigned int _length) {
+    Addr return_address = NULL;
+    Arena* arena = NULL;
+    
+    if (!memory_valid) {
+        return 0;
+    }
+    
+    arena = local_arena();
+    
+    pthread_mutex_lock(&arena->lock);
+    return_address = allocate(arena, _length);
+    pthread_mutex_unlock(&arena->lock);
+    
+    /* Local node exhausted, fall back to the remote ones */
+    for (unsigned int i = 0; return_address == NULL && i < arena_count; i++) {
+        if (&arenas[i] != arena) {
+            pthread_mutex_lock(&arenas[i].lock);
+            return_address = allocate(&arenas[i], _length);
+            pthread_mutex_unlock(&arenas[i].lock);
         }
     }
-  
-error:
+    
+    /* Out of memory path, dip into the emergency pool if one is reserved */
+    if (unlikely(return_address == NULL)) {
+        return_address = my_malloc_emergency(_length);
+    }
+    
+    if (return_address == NULL) {
+        printf("\n!--- FAIL (my_malloc): Not enough memory available. ---!\n");
+    }
+    
+    if (trace_enabled) {
+        trace_record('M', return_address, _length);
+    }
+    
+    return return_address;
+}
+
+
+/* Return the allocated block pointed to by _hdr, of class _size_class, to the
+   arena owning it and coalesce it as far as possible, body of my_free() and
+   my_free_sized(). The class given is trusted to size, merge and link the block.
+   Returns 0 if everything ok, 1 if the address is not owned by the allocator. */
+static int release_block(Header* _hdr, unsigned int _size_class) {
+    Header* hdr = _hdr;
+    unsigned int size_class = _size_class;
+    Arena* arena = owning_arena(_hdr);
+    
+    if (arena == NULL) {
+        printf("\n!--- FAIL (my_free): Address not owned by the allocator. ---!\n");
+        return 1;
+    }
+    
+    pthread_mutex_lock(&arena->lock);
+    
+    /* Contents were handed to the caller, assume they were written. Discarding
+       makes the block known zero again only if it succeeds. */
+    hdr->is_zero = 'N';
+    
+    if ((size_t)class_blocks[ size_class ] * final_basic_block_size >=
+            MY_MALLOC_DONTNEED_THRESHOLD) {
+        discard_block(arena, hdr);
+    }
+    
+    prefetch_for_write(buddy_of(hdr, size_class));
+    
+    remove_from_allocation_queue(arena, hdr);
+    
+    /* Merge first and link the final block once, instead of linking and
+       unlinking the block at every level */
+    while( coalesce(arena, &hdr, &size_class) );
+    
+    make_available_at(arena, hdr, size_class);
+    
+    pthread_mutex_unlock(&arena->lock);
+    
     return 0;
 }
 
 
+extern Addr my_calloc(unsigned int _count, unsigned int _size) {
+    Addr return_address = NULL;
+    unsigned long long length = (unsigned long long)_count * _size;
+    
+    if (length > 0xFFFFFFFFull) {
+        printf("\n!--- FAIL (my_calloc): Requested size overflows. ---!\n");
+        return 0;
+    }
+    
+    return_address = my_malloc((unsigned int)length);
+    
+    /* Emergency slots carry no Header and are always cleared */
+    if (return_address != NULL && (emergency_owns(return_address) ||
+            ((Header*)((char*)return_address - sizeof(Header)))->is_zero != 'Y')) {
+        zero_memory(return_address, (size_t)length);
+    }
+    
+    return return_address;
+}
+
+
 int my_free(Addr _addr) {
     Header* hdr = (Header*)((char*)_addr - sizeof(Header));
     
-    remove_from_allocation_queue(hdr);
-    make_available(hdr);
+    if (trace_enabled) {
+        trace_record('F', _addr, 0);
+    }
+    
+    if (unlikely(emergency_owns(_addr))) {
+        return my_free_emergency(_addr);
+    }
     
-    while( coalesce(&hdr) );
+    if (release_block(hdr, hdr->size_class) != 0) {
+        goto error;
+    }
     
     /* For testing purposes */
     //show_free_list();
@@ -500,15 +1175,511 @@ error:
 }
 
 
-void show_free_list() {
+int my_free_sized(Addr _addr, unsigned int _length) {
+    Header* hdr = (Header*)((char*)_addr - sizeof(Header));
+    unsigned int free_list_index = size_class_for(blocks_for_length(_length));
+    
+    if (unlikely(emergency_owns(_addr))) {
+        if (trace_enabled) {
+            trace_record('F', _addr, _length);
+        }
+        
+        return my_free_emergency(_addr);
+    }
+    
+#ifdef MY_MALLOC_HARDENED
+    if (hdr->header_ident != HEADER_IDENT || hdr->is_free != 'N' ||
+            hdr->size_class != free_list_index) {
+        printf("\n!--- FAIL (my_free_sized): Size does not match block header. ---!\n");
+        goto error;
+    }
+#endif
+    
+    if (trace_enabled) {
+        trace_record('F', _addr, _length);
+    }
+    
+    if (release_block(hdr, free_list_index) != 0) {
+        goto error;
+    }
+    
+    return 0;
+    
+error:
+    return 1;
+}
+
+
+int my_malloc_owns(Addr _addr) {
+    return (memory_valid && owning_arena(_addr) != NULL) || emergency_owns(_addr);
+}
+
+
+int my_malloc_arena(Addr _addr) {
+    Arena* arena = memory_valid ? owning_arena(_addr) : NULL;
+    
+    return arena ? (int)(arena - arenas) : -1;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* EMERGENCY POOL */
+/*--------------------------------------------------------------------------*/
+
+unsigned int init_emergency_pool(unsigned int _slot_size, unsigned int _slot_count) {
+    unsigned int slot_size = (_slot_size + 15) & ~15u;
+    unsigned int word_count = (_slot_count + 63) / 64;
+    size_t bitmap_length = ((word_count * sizeof(uint64_t)) + 63) & ~(size_t)63;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    
+    if (emergency_pool.memory != NULL) {
+        printf("\n!--- FAIL (init_emergency_pool): Pool already reserved. ---!\n");
+        goto error;
+    }
+    
+    if (slot_size == 0 || _slot_count == 0 ||
+            (unsigned long long)slot_size * _slot_count > 0xFFFFFFFFull) {
+        printf("\n!--- FAIL (init_emergency_pool): Invalid pool size. ---!\n");
+        goto error;
+    }
+    
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE; /* Fault every page in now, not when memory is short */
+#endif
+    
+    emergency_pool.length = bitmap_length + (size_t)slot_size * _slot_count;
+    emergency_pool.memory = (char*) mmap(NULL, emergency_pool.length,
+                                         PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (emergency_pool.memory == MAP_FAILED) {
+        emergency_pool.memory = NULL;
+        printf("\n!--- FAIL (init_emergency_pool): Cannot map memory. ---!\n");
+        goto error;
+    }
+    
+    emergency_pool.used = (uint64_t*)emergency_pool.memory;
+    emergency_pool.word_count = word_count;
+    emergency_pool.slot_size = slot_size;
+    emergency_pool.slot_count = _slot_count;
+    
+    /* Mark the slots past the end of the last word as taken */
+    if (_slot_count % 64 != 0) {
+        emergency_pool.used[ word_count - 1 ] = ~0ull << (_slot_count % 64);
+    }
+    
+    /* Publish last, my_malloc_emergency() tests slots without a lock */
+    __atomic_store_n(&emergency_pool.slots, emergency_pool.memory + bitmap_length,
+                     __ATOMIC_RELEASE);
+    
+    return slot_size * _slot_count;
+    
+error:
+    return 0;
+}
+
+
+int release_emergency_pool(void) {
+    if (emergency_pool.memory == NULL) {
+        return 1;
+    }
+    
+    __atomic_store_n(&emergency_pool.slots, NULL, __ATOMIC_RELEASE);
+    munmap(emergency_pool.memory, emergency_pool.length);
+    memset(&emergency_pool, 0, sizeof(emergency_pool));
+    
+    return 0;
+}
+
+
+Addr my_malloc_emergency(unsigned int _length) {
+    char* slots = __atomic_load_n(&emergency_pool.slots, __ATOMIC_ACQUIRE);
+    
+    if (slots == NULL || _length > emergency_pool.slot_size) {
+        return 0;
+    }
+    
+    for (unsigned int w = 0; w < emergency_pool.word_count; w++) {
+        uint64_t bits = __atomic_load_n(&emergency_pool.used[w], __ATOMIC_RELAXED);
+        
+        /* A failed exchange reloads bits, retry until the word is full */
+        while (bits != ~0ull) {
+            unsigned int bit = (unsigned int)__builtin_ctzll(~bits);
+            
+            if (__atomic_compare_exchange_n(&emergency_pool.used[w], &bits,
+                                            bits | (1ull << bit), 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return slots + (size_t)(w * 64 + bit) * emergency_pool.slot_size;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+
+int my_free_emergency(Addr _addr) {
+    char* slots = __atomic_load_n(&emergency_pool.slots, __ATOMIC_ACQUIRE);
+    size_t offset = 0;
+    size_t slot = 0;
+    
+    if (!emergency_owns(_addr)) {
+        return 1;
+    }
+    
+    offset = (size_t)((char*)_addr - slots);
+    slot = offset / emergency_pool.slot_size;
+    
+    if (offset % emergency_pool.slot_size != 0) {
+        return 1;
+    }
+    
+    __atomic_fetch_and(&emergency_pool.used[ slot / 64 ], ~(1ull << (slot % 64)),
+                       __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* HEAP IMAGES */
+/*--------------------------------------------------------------------------*/
+
+/* Write the contents of _arena at _offset of _file. Pages that are entirely zero
+   are skipped and left as holes, which read back as zero. Returns 0 if
+   everything ok. */
+static int write_arena_contents(FILE* _file, Arena* _arena, unsigned long long _offset,
+                                size_t _page_size) {
+    char* page = (char*)_arena->allocated_memory_front;
+    
+    while (page < (char*)_arena->allocated_memory_back) {
+        size_t length = (char*)_arena->allocated_memory_back - page;
+        size_t word = 0;
+        
+        if (length > _page_size) {
+            length = _page_size;
+        }
+        
+        while (word < length / sizeof(unsigned long) && ((unsigned long*)page)[ word ] == 0) {
+            ++word;
+        }
+        
+        if (word * sizeof(unsigned long) < length) {
+            if (fseeko(_file, (off_t)(_offset + (page - (char*)_arena->allocated_memory_front)),
+                       SEEK_SET) != 0 || fwrite(page, 1, length, _file) != length) {
+                return 1;
+            }
+        }
+        
+        page += length;
+    }
+    
+    return 0;
+}
+
+
+/* Shift the prev and next links of every Header in _arena by _delta bytes, after
+   its image was mapped away from the saved address. Returns 0 if everything ok,
+   1 if a corrupt Header is found. */
+static int rebase_arena(Arena* _arena, intptr_t _delta) {
+    char* hdr = (char*)_arena->allocated_memory_front;
+    
+    while (hdr < (char*)_arena->allocated_memory_back) {
+        if (((Header*)hdr)->header_ident != HEADER_IDENT || ((Header*)hdr)->block_count == 0) {
+            return 1;
+        }
+        
+        if (((Header*)hdr)->prev != NULL) {
+            ((Header*)hdr)->prev = (Header*)((char*)((Header*)hdr)->prev + _delta);
+        }
+        if (((Header*)hdr)->next != NULL) {
+            ((Header*)hdr)->next = (Header*)((char*)((Header*)hdr)->next + _delta);
+        }
+        
+        hdr += (size_t)((Header*)hdr)->block_count * final_basic_block_size;
+    }
+    
+    return 0;
+}
+
+
+int save_heap_image(const char* _path, Addr _root) {
+    HeapImageHeader* image = NULL;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned long long offset = 0;
+    char temp_path[ 4096 ];
+    FILE* file = NULL;
+    unsigned int written = 0;
+    
+    if (!memory_valid) {
+        printf("\n!--- FAIL (save_heap_image): Allocator not initialized. ---!\n");
+        return 1;
+    }
+    
+    /* Written aside and renamed over _path, truncating a file that other
+       processes have mapped would fault their untouched pages */
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", _path) >= (int)sizeof(temp_path)) {
+        printf("\n!--- FAIL (save_heap_image): Path too long. ---!\n");
+        return 1;
+    }
+    
+    image = (HeapImageHeader*) calloc(1, sizeof(HeapImageHeader));
+    file = fopen(temp_path, "wb");
+    
+    if (image == NULL || file == NULL) {
+        printf("\n!--- FAIL (save_heap_image): Cannot open image file. ---!\n");
+        goto error;
+    }
+    
+    memcpy(image->magic, HEAP_IMAGE_MAGIC, sizeof(image->magic));
+    image->version = HEAP_IMAGE_VERSION;
+    image->header_size = sizeof(HeapImageHeader);
+    image->basic_block_size = final_basic_block_size;
+    image->size_class_policy = SIZE_CLASS_POLICY;
+    image->size_class_order = SIZE_CLASS_K;
+    image->size_class_count = size_class_count;
+    image->root = (uint64_t)(uintptr_t)_root;
+    memcpy(image->cpu_arena, cpu_arena, sizeof(cpu_arena));
+    
+    offset = (sizeof(HeapImageHeader) + page_size - 1) & ~(unsigned long long)(page_size - 1);
+    
+    /* Every arena stays still while it is copied, as around fork() */
+    allocator_fork_prepare();
+    
+    image->arena_count = arena_count;
+    
+    for (unsigned int i = 0; i < arena_count; i++) {
+        HeapImageArena* saved = &image->arenas[i];
+        
+        saved->base = (uint64_t)(uintptr_t)arenas[i].allocated_memory_front;
+        saved->offset = offset;
+        saved->final_allocation_size = arenas[i].final_allocation_size;
+        saved->free_list_size = arenas[i].free_list_size;
+        saved->node = arenas[i].node;
+        saved->split_count = arenas[i].split_count;
+        saved->coalesce_count = arenas[i].coalesce_count;
+        
+        for (unsigned int j = 0; j < arenas[i].free_list_size; j++) {
+            saved->free_list[j] = (uint64_t)(uintptr_t)arenas[i].free_list[j];
+        }
+        
+        if (write_arena_contents(file, &arenas[i], offset, page_size) != 0) {
+            break;
+        }
+        
+        offset += (arenas[i].final_allocation_size + page_size - 1) &
+                  ~(unsigned long long)(page_size - 1);
+        ++written;
+    }
+    
+    allocator_fork_parent();
+    
+    if (written != image->arena_count || fseeko(file, 0, SEEK_SET) != 0 ||
+            fwrite(image, sizeof(HeapImageHeader), 1, file) != 1 || fflush(file) != 0 ||
+            ftruncate(fileno(file), (off_t)offset) != 0) {
+        printf("\n!--- FAIL (save_heap_image): Problem writing image file. ---!\n");
+        goto error;
+    }
+    
+    if (fclose(file) != 0) {
+        file = NULL;
+        printf("\n!--- FAIL (save_heap_image): Problem writing image file. ---!\n");
+        goto error;
+    }
+    
+    file = NULL;
+    
+    if (rename(temp_path, _path) != 0) {
+        printf("\n!--- FAIL (save_heap_image): Cannot replace image file. ---!\n");
+        goto error;
+    }
+    
+    free(image);
+    
+    return 0;
+    
+error:
+    if (file != NULL) {
+        fclose(file);
+    }
+    remove(temp_path);
+    free(image);
+    return 1;
+}
+
+
+unsigned int restore_heap_image(const char* _path, unsigned int _flags, Addr* _root) {
+    HeapImageHeader* image = NULL;
+    unsigned long long total_size = 0;
+    unsigned int restored = 0;
+    unsigned int rebased = 0;
+    uint64_t root = 0;
+    FILE* file = NULL;
+    struct stat file_status;
+    
+    if (memory_valid) {
+        printf("\n!--- FAIL (restore_heap_image): Allocator already initialized. ---!\n");
+        return 0;
+    }
+    
+    image = (HeapImageHeader*) calloc(1, sizeof(HeapImageHeader));
+    file = fopen(_path, "rb");
+    
+    if (image == NULL || file == NULL) {
+        printf("\n!--- FAIL (restore_heap_image): Cannot open image file. ---!\n");
+        goto error;
+    }
+    
+    if (fread(image, sizeof(HeapImageHeader), 1, file) != 1 ||
+            memcmp(image->magic, HEAP_IMAGE_MAGIC, sizeof(image->magic)) != 0 ||
+            image->version != HEAP_IMAGE_VERSION ||
+            image->header_size != sizeof(HeapImageHeader) ||
+            image->arena_count == 0 || image->arena_count > MAX_NUMA_NODES ||
+            fstat(fileno(file), &file_status) != 0) {
+        printf("\n!--- FAIL (restore_heap_image): Not a compatible image file. ---!\n");
+        goto error;
+    }
+    
+    set_basic_block_size(image->basic_block_size);
+    
+    if (image->size_class_policy != SIZE_CLASS_POLICY ||
+            image->size_class_order != SIZE_CLASS_K ||
+            image->size_class_count != size_class_count ||
+            image->basic_block_size != final_basic_block_size) {
+        printf("\n!--- FAIL (restore_heap_image): Image uses other size classes. ---!\n");
+        goto error;
+    }
+    
+    root = image->root;
+    
+    for (restored = 0; restored < image->arena_count; restored++) {
+        Arena* arena = &arenas[ restored ];
+        HeapImageArena* saved = &image->arenas[ restored ];
+        void* base = (void*)(uintptr_t)saved->base;
+        intptr_t delta = 0;
+        
+        if (saved->free_list_size == 0 || saved->free_list_size > size_class_count ||
+                (unsigned long long)class_blocks[ saved->free_list_size - 1 ] *
+                final_basic_block_size != saved->final_allocation_size) {
+            printf("\n!--- FAIL (restore_heap_image): Not a compatible image file. ---!\n");
+            goto error;
+        }
+        
+        /* Pages past the end of a truncated file would fault on first touch */
+        if (saved->offset % (uint64_t)sysconf(_SC_PAGESIZE) != 0 ||
+                saved->offset + saved->final_allocation_size > (uint64_t)file_status.st_size) {
+            printf("\n!--- FAIL (restore_heap_image): Image file is truncated. ---!\n");
+            goto error;
+        }
+        
+        for (unsigned int j = 0; j < saved->free_list_size; j++) {
+            if (saved->free_list[j] != 0 && (saved->free_list[j] < saved->base ||
+                    saved->free_list[j] >= saved->base + saved->final_allocation_size ||
+                    (saved->free_list[j] - saved->base) % final_basic_block_size != 0)) {
+                printf("\n!--- FAIL (restore_heap_image): Invalid free list head. ---!\n");
+                goto error;
+            }
+        }
+        
+        /* Pinned at the saved address the image is used as is, and pages the
+           process never writes stay shared with the page cache */
+        arena->allocated_memory_front = mmap(base, saved->final_allocation_size,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+                                             fileno(file), (off_t)saved->offset);
+        
+        if (arena->allocated_memory_front != MAP_FAILED &&
+                arena->allocated_memory_front != base) {
+            munmap(arena->allocated_memory_front, saved->final_allocation_size);
+            arena->allocated_memory_front = MAP_FAILED;
+        }
+        
+        if (arena->allocated_memory_front == MAP_FAILED && (_flags & HEAP_IMAGE_REBASE)) {
+            arena->allocated_memory_front = mmap(NULL, saved->final_allocation_size,
+                                                 PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                                 fileno(file), (off_t)saved->offset);
+        }
+        
+        if (arena->allocated_memory_front == MAP_FAILED) {
+            arena->allocated_memory_front = NULL;
+            printf("\n!--- FAIL (restore_heap_image): Cannot map image at its address. ---!\n");
+            goto error;
+        }
+        
+        delta = (intptr_t)arena->allocated_memory_front - (intptr_t)saved->base;
+        
+        arena->allocated_memory_back = (char*)arena->allocated_memory_front +
+                                       saved->final_allocation_size;
+        arena->final_allocation_size = saved->final_allocation_size;
+        arena->free_list_size = saved->free_list_size;
+        arena->free_list = (Header**) malloc(arena->free_list_size * sizeof(Header*));
+        arena->node = saved->node;
+        arena->split_count = saved->split_count;
+        arena->coalesce_count = saved->coalesce_count;
+        arena->image_backed = 1;
+        pthread_mutex_init(&arena->lock, NULL);
+        
+        for (unsigned int j = 0; j < arena->free_list_size; j++) {
+            arena->free_list[j] = saved->free_list[j] == 0 ? NULL :
+                                  (Header*)(uintptr_t)(saved->free_list[j] + delta);
+        }
+        
+        if (delta != 0) {
+            ++rebased;
+            
+            if (root >= saved->base && root < saved->base + saved->final_allocation_size) {
+                root += delta;
+            }
+            
+            if (rebase_arena(arena, delta) != 0) {
+                printf("\n!--- FAIL (restore_heap_image): Invalid block access. ---!\n");
+                ++restored; /* Mapped, released below */
+                goto error;
+            }
+        }
+        
+        if (arena->node >= 0) {
+            bind_arena(arena);
+        }
+        
+        total_size += arena->final_allocation_size;
+    }
+    
+    memcpy(cpu_arena, image->cpu_arena, sizeof(cpu_arena));
+    arena_count = image->arena_count;
+    memory_valid = 1; /* Allow allocations */
+    
+    printf("\nHeap image restored: %u arena(s), %u rebased.\n", arena_count, rebased);
+    
+    if (_root != NULL) {
+        *_root = (Addr)(uintptr_t)root;
+    }
+    
+    fclose(file); /* The mappings keep the file open */
+    free(image);
+    
+    return total_size > 0xFFFFFFFFull ? 0xFFFFFFFFu : (unsigned int)total_size;
+    
+error:
+    while (restored-- > 0) {
+        release_arena(&arenas[ restored ]);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(image);
+    return 0;
+}
+
+
+/* Output free_list data of _arena, whose lock must be held */
+static void show_arena_free_list(Arena* _arena) {
     printf("\n\n");
-    for (int i = 1; i <= free_list_size; i++) {
+    for (int i = 1; i <= _arena->free_list_size; i++) {
         
-        void* hdr = free_list[ free_list_size - i ];
+        void* hdr = _arena->free_list[ _arena->free_list_size - i ];
         
         if (hdr != NULL) {
             
-            printf("[%i]: ", free_list_size - i);
+            printf("[%i]: ", _arena->free_list_size - i);
             
             do {
                 if (((Header*)hdr)->header_ident == HEADER_IDENT) {
@@ -524,11 +1695,207 @@ void show_free_list() {
             
         } else {
             
-            printf("[%i]: Empty\n", free_list_size - i);
+            printf("[%i]: Empty\n", _arena->free_list_size - i);
             
         }
     }
 }
 
 
+/* Body of get_arena_heap_snapshot(), the lock of _arena must be held */
+static int snapshot_arena(Arena* _arena, HeapSnapshot* _snapshot,
+                          unsigned char* _occupancy, unsigned int _cells) {
+    unsigned int* cell_blocks = NULL;
+    unsigned int block_index = 0;
+    void* hdr = _arena->allocated_memory_front;
+    
+    _snapshot->node = _arena->node;
+    _snapshot->basic_block_size = final_basic_block_size;
+    _snapshot->total_blocks = _arena->final_allocation_size / final_basic_block_size;
+    _snapshot->class_count = _arena->free_list_size;
+    
+    if (_occupancy != NULL && _cells > 0) {
+        cell_blocks = (unsigned int*) calloc(_cells, sizeof(unsigned int));
+    }
+    
+    /* Blocks tile the arena, so striding by block_count visits each exactly once */
+    while (hdr < _arena->allocated_memory_back) {
+        unsigned int block_count = ((Header*)hdr)->block_count;
+        unsigned long long bytes = (unsigned long long)block_count * final_basic_block_size;
+        
+        if (((Header*)hdr)->header_ident != HEADER_IDENT || block_count == 0 ||
+                block_index + block_count > _snapshot->total_blocks) {
+            printf("\n!--- FAIL (get_heap_snapshot): Invalid block access. ---!\n");
+            free(cell_blocks);
+            goto error;
+        }
+        
+        if (((Header*)hdr)->is_free == 'Y') {
+            unsigned int free_list_index = ((Header*)hdr)->size_class;
+            
+            ++_snapshot->free_count[ free_list_index ];
+            _snapshot->free_bytes_by_class[ free_list_index ] += bytes;
+            _snapshot->free_bytes += bytes;
+            
+            if (bytes > _snapshot->largest_free_block) {
+                _snapshot->largest_free_block = bytes;
+            }
+        } else {
+            if (((Header*)hdr)->is_free == 'N') {
+                ++_snapshot->allocated_count;
+            }
+            _snapshot->allocated_bytes += bytes;
+            
+            /* Credit each cell the block overlaps with its share of the block */
+            if (cell_blocks != NULL) {
+                unsigned long long total = _snapshot->total_blocks;
+                unsigned long long end = block_index + block_count;
+                unsigned int cell = (unsigned int)((unsigned long long)block_index * _cells / total);
+                
+                for (; cell < _cells; cell++) {
+                    unsigned long long cell_start = cell * total / _cells;
+                    unsigned long long cell_end = (cell + 1) * total / _cells;
+                    
+                    if (cell_start >= end) {
+                        break;
+                    }
+                    
+                    cell_blocks[ cell ] += (unsigned int)(
+                        (end < cell_end ? end : cell_end) -
+                        (block_index > cell_start ? block_index : cell_start));
+                }
+            }
+        }
+        
+        block_index += block_count;
+        hdr = (char*)hdr + bytes;
+    }
+    
+    _snapshot->split_count = _arena->split_count;
+    _snapshot->coalesce_count = _arena->coalesce_count;
+    
+    if (_snapshot->free_bytes > 0) {
+        _snapshot->external_fragmentation = 1.0 -
+            (double)_snapshot->largest_free_block / (double)_snapshot->free_bytes;
+    }
+    
+    if (cell_blocks != NULL) {
+        unsigned long long total = _snapshot->total_blocks;
+        
+        for (unsigned int cell = 0; cell < _cells; cell++) {
+            unsigned long long cell_size = (cell + 1) * total / _cells - cell * total / _cells;
+            
+            _occupancy[ cell ] = cell_size ?
+                (unsigned char)(cell_blocks[ cell ] * 255ull / cell_size) : 0;
+        }
+        
+        free(cell_blocks);
+    }
+    
+    return 0;
+    
+error:
+    return 1;
+}
+
 
+void show_free_list() {
+    for (unsigned int a = 0; a < arena_count; a++) {
+        Arena* arena = &arenas[a];
+        
+        pthread_mutex_lock(&arena->lock);
+        
+        if (arena_count > 1) {
+            printf("\n\nArena %u (node %i):", a, arena->node);
+        }
+        
+        show_arena_free_list(arena);
+        
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+
+int get_heap_snapshot(HeapSnapshot* _snapshot, unsigned char* _occupancy,
+                      unsigned int _cells) {
+    return get_arena_heap_snapshot(0, _snapshot, _occupancy, _cells);
+}
+
+
+int get_arena_heap_snapshot(unsigned int _arena_index, HeapSnapshot* _snapshot,
+                            unsigned char* _occupancy, unsigned int _cells) {
+    int result = 0;
+    
+    memset(_snapshot, 0, sizeof(HeapSnapshot));
+    
+    if (!memory_valid || _arena_index >= arena_count) {
+        return 1;
+    }
+    
+    pthread_mutex_lock(&arenas[ _arena_index ].lock);
+    result = snapshot_arena(&arenas[ _arena_index ], _snapshot, _occupancy, _cells);
+    pthread_mutex_unlock(&arenas[ _arena_index ].lock);
+    
+    return result;
+}
+
+
+void write_heap_map_ascii(FILE* _out, const unsigned char* _occupancy,
+                          unsigned int _cells, unsigned int _width) {
+    static const char ramp[] = " .:-=+*#%@";
+    
+    if (_width == 0) {
+        _width = 64;
+    }
+    
+    for (unsigned int cell = 0; cell < _cells; cell++) {
+        fputc(ramp[ _occupancy[ cell ] * (sizeof(ramp) - 2) / 255 ], _out);
+        
+        if ((cell + 1) % _width == 0 || cell + 1 == _cells) {
+            fputc('\n', _out);
+        }
+    }
+}
+
+
+int write_heap_map_ppm(const char* _path, const unsigned char* _occupancy,
+                       unsigned int _cells, unsigned int _width) {
+    FILE* file = NULL;
+    unsigned int height = 0;
+    
+    if (_width == 0) {
+        _width = 64;
+    }
+    
+    height = (_cells + _width - 1) / _width;
+    
+    file = fopen(_path, "wb");
+    if (file == NULL) {
+        printf("\n!--- FAIL (write_heap_map_ppm): Cannot open output file. ---!\n");
+        goto error;
+    }
+    
+    fprintf(file, "P6\n%u %u\n255\n", _width, height);
+    
+    for (unsigned int cell = 0; cell < _width * height; cell++) {
+        /* Cells past the end of the map are drawn black */
+        unsigned char value = cell < _cells ? _occupancy[ cell ] : 0;
+        unsigned char pixel[3] = { value, 0, (unsigned char)(255 - value) };
+        
+        if (cell >= _cells) {
+            pixel[2] = 0;
+        }
+        
+        fwrite(pixel, 1, 3, file);
+    }
+    
+    if (fclose(file) != 0) {
+        printf("\n!--- FAIL (write_heap_map_ppm): Problem writing output file. ---!\n");
+        goto error;
+    }
+    
+    return 0;
+    
+error:
+    return 1;
+}
@@ -18,6 +18,43 @@
 #ifndef __Memory_Allocator__C___my_malloc__
 #define __Memory_Allocator__C___my_malloc__
 #define HEADER_IDENT 1138
+#define MAX_SIZE_CLASSES 128 /* Upper bound on free_list_size */
+#define MAX_NUMA_NODES 64 /* Upper bound on the number of arenas */
+
+/* Size class policies, select one at compile time with -DSIZE_CLASS_POLICY=...
+   Every policy builds classes S(1) = 1 < S(2) < ... basic blocks, and splits a
+   block of class n into a left child of class n-1 and a right child of class
+   n-k (class 1 while n <= k), plus a padding block where the sizes leave one. */
+#define SIZE_CLASS_FIBONACCI 0   /* S(n) = S(n-1) + S(n-2): 1, 2, 3, 5, 8, ... */
+#define SIZE_CLASS_LEONARDO 1    /* S(n) = S(n-1) + S(n-2) + 1: 1, 3, 5, 9, 15, ...
+                                    the extra block is a padding block */
+#define SIZE_CLASS_GENERALIZED 2 /* S(n) = S(n-1) + S(n-k), k = SIZE_CLASS_ORDER */
+#define SIZE_CLASS_BUDDY 3       /* S(n) = 2 * S(n-1): 1, 2, 4, 8, ... */
+
+#ifndef SIZE_CLASS_POLICY
+#define SIZE_CLASS_POLICY SIZE_CLASS_FIBONACCI
+#endif
+
+#ifndef SIZE_CLASS_ORDER
+#define SIZE_CLASS_ORDER 3
+#endif
+
+/* Freed blocks of at least this many bytes are handed back to the kernel with
+   MADV_DONTNEED, which also makes them known zero for my_calloc() */
+#ifndef MY_MALLOC_DONTNEED_THRESHOLD
+#define MY_MALLOC_DONTNEED_THRESHOLD (1024 * 1024)
+#endif
+
+/* my_calloc() clears at least this many bytes with non-temporal stores, which
+   bypass the cache instead of evicting the caller's working set */
+#ifndef MY_MALLOC_STREAM_THRESHOLD
+#define MY_MALLOC_STREAM_THRESHOLD (256 * 1024)
+#endif
+
+/* restore_heap_image() flag: when a saved address is taken, map the arena
+   elsewhere and rebase the allocator's links instead of failing. Only for heaps
+   whose blocks hold offsets rather than pointers. */
+#define HEAP_IMAGE_REBASE 1
 
 /*--------------------------------------------------------------------------------*/
 /* INCLUDES */
@@ -26,6 +63,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*--------------------------------------------------------------------------------*/
 /* DATA STRUCTURES */
 /*--------------------------------------------------------------------------------*/
@@ -35,15 +76,42 @@ typedef struct Header {
     unsigned short int header_ident; /* For identifying a Header element, a const */
     unsigned int block_count; /* Number of blocks this Header is responsible for, 
                                  multiplied w/ basic_block_size to find size of 
-                                 block in bytes. Should be a fibonacci number */
-    char is_free; /* 'Y'es or 'N'o */
+                                 block in bytes. One of the size class sizes */
+    char is_free; /* 'Y'es, 'N'o, or 'P'adding left over by a split, never
+                      allocated */
     char child; /* 'L'eft or 'R'ight */
     char inherit; /* 'inherit' holds left child's parent's 'child' bit, and right 
                       child's parent's 'inherit' bit */
+    unsigned char size_class; /* Index into the size class tables, the free_list
+                                 index of this block when free */
+    unsigned char parent_class; /* Right child: size class of its parent. Left
+                                   child: its parent's 'parent_class', handed
+                                   down like 'inherit' */
+    char is_zero; /* 'Y' if every byte after the Header is known to be zero, 'N'
+                     otherwise. Kept while allocated, cleared on free. */
     struct Header *prev; /* pointer to previous memory block */
     struct Header *next; /* pointer to next memory block */
 } Header;
 
+/* Point-in-time summary of the heap, filled by get_heap_snapshot() */
+typedef struct HeapSnapshot {
+    int node; /* NUMA node of the arena, -1 if its memory is not bound */
+    unsigned int basic_block_size;
+    unsigned int total_blocks; /* Basic blocks in the arena */
+    unsigned int class_count; /* Entries used in the per-class arrays, index 0
+                                 (the allocation queue) is always empty */
+    unsigned int free_count[MAX_SIZE_CLASSES]; /* Free blocks per size class */
+    unsigned long long free_bytes_by_class[MAX_SIZE_CLASSES];
+    unsigned int allocated_count;
+    unsigned long long allocated_bytes; /* Including Headers, rounding and padding */
+    unsigned long long free_bytes;
+    unsigned long long largest_free_block; /* In bytes, Header included */
+    double external_fragmentation; /* 1 - largest_free_block / free_bytes, 0 if
+                                      nothing is free */
+    unsigned long long split_count; /* Splits since init_allocator() */
+    unsigned long long coalesce_count; /* Coalesces since init_allocator() */
+} HeapSnapshot;
+
 /*--------------------------------------------------------------------------------*/
 /* MODULE MY_MALLOC */
 /*--------------------------------------------------------------------------------*/
@@ -54,7 +122,8 @@ typedef void* Addr;
 
 /* Return Fibonacci number closest to _min_number, if return_fib_index == 1, then
    return index of fibonnaci number in Fibonacci sequence, else if 
-   return_fib_index == 0 return actual fibonnaci number */
+   return_fib_index == 0 return actual fibonnaci number. This is the classic
+   sequence whatever SIZE_CLASS_POLICY is, the allocator uses its own tables. */
 unsigned int find_fibonacci(unsigned int _min_number,
                             unsigned int* _n1,
                             unsigned int* _n2,
@@ -69,22 +138,157 @@ unsigned int find_fibonacci(unsigned int _min_number,
 unsigned int init_allocator(unsigned int basic_block_size, unsigned int length);
 
 
+/* Like init_allocator(), but sets up one arena of 'length' bytes per NUMA node,
+   with its memory bound to that node. my_malloc() serves each thread from the
+   arena of the node it runs on, falling back to the other nodes when that one is
+   exhausted, and frees go back to the arena owning the block. Where NUMA is
+   absent or there is a single node, this is init_allocator(). Returns the total
+   amount of memory made available, 0 on error. */
+unsigned int init_numa_allocator(unsigned int basic_block_size, unsigned int length);
+
+
+/* Number of arenas in use, one per NUMA node, 0 if not initialized */
+unsigned int allocator_arena_count(void);
+
+
 /* release_allocator() returns any allocated memory to the operating system.
    After this function is called, any allocation fails. */
 int release_allocator();
 
 
+/* Fork handlers, registered with pthread_atfork() on the first initialization.
+   allocator_fork_prepare() takes every arena lock so that no free list is
+   half-updated when the address space is copied, and allocator_fork_parent()
+   releases them. allocator_fork_child() re-creates the locks in the child, which
+   then inherits the heap copy-on-write: blocks allocated before the fork stay
+   valid and can be freed in the child. A child that wants an empty heap instead
+   calls release_allocator() then init_allocator() again. Code that creates
+   processes without running the atfork handlers, such as a raw clone(), must
+   call allocator_fork_child() first in the child, and is only safe if no other
+   thread was inside the allocator. */
+void allocator_fork_prepare(void);
+void allocator_fork_parent(void);
+void allocator_fork_child(void);
+
+
 /* Allocate length number of bytes of free memory and returns the
    address of the allocated portion. Returns 0 when out of memory. */
 Addr my_malloc(unsigned int length);
 
 
+/* Allocate zero-filled memory for an array of _count elements of _size bytes.
+   Blocks known to be zero are returned without clearing them. Returns 0 when out
+   of memory or if the total size overflows. */
+Addr my_calloc(unsigned int _count, unsigned int _size);
+
+
 /* Frees the section of physical memory previously allocated
    using ’my_malloc’. Returns 0 if everything ok. */
 int my_free(Addr _addr);
 
 
+/* Frees the section of physical memory previously allocated using
+   'my_malloc(_length)'. The size class is computed from '_length' and used to
+   size, coalesce and link the block instead of being decoded from the block's
+   Header, so '_length' must be the length that was allocated. When compiled
+   with MY_MALLOC_HARDENED, '_length' is cross-checked against the Header and a
+   mismatch is refused. Returns 0 if everything ok. */
+int my_free_sized(Addr _addr, unsigned int _length);
+
+
+/* Returns 1 if _addr lies inside the memory managed by the allocator, 0 
+   otherwise (including when the allocator is not initialized). */
+int my_malloc_owns(Addr _addr);
+
+
+/* Returns the index of the arena holding _addr, -1 if the allocator does not own
+   it */
+int my_malloc_arena(Addr _addr);
+
+
+/* Reserve an emergency pool of 'slot_count' slots of 'slot_size' bytes, rounded
+   up to 16, independent of the arenas and faulted in up front. my_malloc() falls
+   back to it once every arena is exhausted, and signal handlers can use it
+   directly through my_malloc_emergency(). Returns the number of bytes reserved,
+   0 on error or if a pool is already reserved. */
+unsigned int init_emergency_pool(unsigned int slot_size, unsigned int slot_count);
+
+
+/* Unmap the emergency pool, its slots must no longer be in use. Returns 0 if
+   everything ok, 1 if no pool is reserved. */
+int release_emergency_pool(void);
+
+
+/* Allocate one emergency slot for 'length' bytes. Async-signal-safe: takes no
+   lock, makes no system call and prints nothing. Returns 0 when no pool is
+   reserved, 'length' exceeds the slot size or every slot is taken. */
+Addr my_malloc_emergency(unsigned int length);
+
+
+/* Release a slot from my_malloc_emergency(), async-signal-safe. my_free() also
+   accepts emergency slots, but is not async-signal-safe. Returns 0 if everything
+   ok, 1 if _addr is not the start of an emergency slot. */
+int my_free_emergency(Addr _addr);
+
+
+/* Write every arena, Headers, free lists and block contents, to a heap image at
+   _path, which restore_heap_image() maps back in another process. '_root' is
+   stored with it, typically the root of an object graph built in the heap. Pages
+   that are entirely zero are left as holes in the file. The image is written
+   next to _path and renamed over it, so processes still mapping an older image
+   at _path are not disturbed. Returns 0 if everything ok. */
+int save_heap_image(const char* _path, Addr _root);
+
+
+/* Initialize the allocator from the heap image at _path instead of
+   init_allocator(). Each arena is a private mapping of the file: restoring
+   costs page faults on the pages actually touched, and pages a process only
+   reads stay shared with every other process restoring the same image. Arenas
+   are mapped at the addresses they had when saved, so pointers stored in blocks
+   remain valid, and the restore fails if an address is taken. With
+   HEAP_IMAGE_REBASE in _flags, such an arena is mapped elsewhere and the
+   allocator's own links are rebased instead, which writes every Header; block
+   contents are not rebased, so the heap must hold offsets rather than pointers.
+   The image must come from a build with the same size class policy. On success,
+   _root (if not NULL) receives the root given to save_heap_image(), rebased with
+   its arena. Returns the amount of memory made available, 0 on error or if the
+   allocator is initialized. */
+unsigned int restore_heap_image(const char* _path, unsigned int _flags, Addr* _root);
+
+
 /* Output free_list data */
 void show_free_list();
 
+
+/* Fill _snapshot by walking every block of the arena in address order. If
+   _occupancy is not NULL it receives an address-ordered map of _cells cells,
+   each the allocated share of its slice of the arena from 0 (free) to 255 (fully
+   allocated). Returns 0 if everything ok, 1 if the allocator is not initialized
+   or a corrupt Header is found. */
+int get_heap_snapshot(HeapSnapshot* _snapshot, unsigned char* _occupancy,
+                      unsigned int _cells);
+
+
+/* Like get_heap_snapshot(), for arena _arena_index, from 0 to
+   allocator_arena_count() - 1. get_heap_snapshot() covers arena 0. */
+int get_arena_heap_snapshot(unsigned int _arena_index, HeapSnapshot* _snapshot,
+                            unsigned char* _occupancy, unsigned int _cells);
+
+
+/* Render an occupancy map from get_heap_snapshot() as ASCII art, _width cells
+   per line, denser characters for fuller cells */
+void write_heap_map_ascii(FILE* _out, const unsigned char* _occupancy,
+                          unsigned int _cells, unsigned int _width);
+
+
+/* Render an occupancy map from get_heap_snapshot() as a binary PPM image,
+   _width pixels wide, shading from blue (free) to red (allocated). Returns 0 if
+   everything ok. */
+int write_heap_map_ppm(const char* _path, const unsigned char* _occupancy,
+                       unsigned int _cells, unsigned int _width);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* defined(__Memory_Allocator__C___my_malloc__) */
@@ -0,0 +1,135 @@
+/***********************************************************************************
+ File: my_malloc_new.cpp
+
+ This file replaces the global C++ operator new/delete with the my_malloc module.
+ Linking it into a C++ program routes every new-expression through my_malloc()
+ and every sized delete through my_free_sized().
+
+ Requests the allocator cannot serve (not yet initialized, out of memory, or
+ larger than an unsigned int) fall back to malloc(), and deletes are routed back
+ by address with my_malloc_owns(). Objects living in the allocator's memory must
+ be destroyed before release_allocator() is called.
+
+ operator new must return memory aligned to __STDCPP_DEFAULT_NEW_ALIGNMENT__.
+ Blocks are aligned to the arena's basic_block_size, so pick a basic block size
+ that is a multiple of it; a block that is not aligned is returned and the
+ request is served by malloc() instead.
+***********************************************************************************/
+
+
+#include <new>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+
+#include "my_malloc.h"
+
+
+/*--------------------------------------------------------------------------*/
+/* LOCAL FUNCTIONS */
+/*--------------------------------------------------------------------------*/
+
+static void* fib_new(std::size_t _size) {
+    void* addr = NULL;
+
+    if (_size <= UINT_MAX) {
+        addr = my_malloc((unsigned int)_size);
+    }
+
+    if (addr != NULL && (std::uintptr_t)addr % __STDCPP_DEFAULT_NEW_ALIGNMENT__ != 0) {
+        my_free(addr);
+        addr = NULL;
+    }
+
+    if (addr == NULL) {
+        addr = std::malloc(_size ? _size : 1);
+    }
+
+    return addr;
+}
+
+
+static void fib_delete(void* _addr) {
+    if (_addr == NULL) {
+        return;
+    }
+
+    if (my_malloc_owns(_addr)) {
+        my_free(_addr);
+    } else {
+        std::free(_addr);
+    }
+}
+
+
+static void fib_delete_sized(void* _addr, std::size_t _size) {
+    if (_addr == NULL) {
+        return;
+    }
+
+    if (my_malloc_owns(_addr)) {
+        my_free_sized(_addr, (unsigned int)_size);
+    } else {
+        std::free(_addr);
+    }
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* REPLACEMENT FUNCTIONS */
+/*--------------------------------------------------------------------------*/
+
+void* operator new(std::size_t _size) {
+    void* addr = fib_new(_size);
+
+    if (addr == NULL) {
+        throw std::bad_alloc();
+    }
+
+    return addr;
+}
+
+
+void* operator new[](std::size_t _size) {
+    return operator new(_size);
+}
+
+
+void* operator new(std::size_t _size, const std::nothrow_t&) noexcept {
+    return fib_new(_size);
+}
+
+
+void* operator new[](std::size_t _size, const std::nothrow_t&) noexcept {
+    return fib_new(_size);
+}
+
+
+void operator delete(void* _addr) noexcept {
+    fib_delete(_addr);
+}
+
+
+void operator delete[](void* _addr) noexcept {
+    fib_delete(_addr);
+}
+
+
+void operator delete(void* _addr, const std::nothrow_t&) noexcept {
+    fib_delete(_addr);
+}
+
+
+void operator delete[](void* _addr, const std::nothrow_t&) noexcept {
+    fib_delete(_addr);
+}
+
+
+void operator delete(void* _addr, std::size_t _size) noexcept {
+    fib_delete_sized(_addr, _size);
+}
+
+
+void operator delete[](void* _addr, std::size_t _size) noexcept {
+    fib_delete_sized(_addr, _size);
+}
@@ -0,0 +1,291 @@
+/***********************************************************************************
+ File: trace_replay.c
+
+ This file contains the main() function of the trace replay driver. It loads a
+ trace written by the alloc_trace module, orders it by timestamp and re-executes
+ it, single-threaded, against my_malloc/my_free or the system malloc/free so the
+ two can be compared under the same load. Every allocation is filled, as a real
+ caller would, so page faults are part of the measurement.
+
+ Usage: trace_replay <trace file> [fib|glibc] [basic block size] [arena length]
+***********************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+#include "alloc_trace.h"
+#include "my_malloc.h"
+
+
+/*--------------------------------------------------------------------------*/
+/* DATA STRUCTURES */
+/*--------------------------------------------------------------------------*/
+
+/* Trace event plus replay bookkeeping */
+typedef struct ReplayEvent {
+    TraceEvent event;
+    unsigned int order; /* Position in the file, keeps sorting stable */
+    long match; /* For a free: index of the allocation it releases, -1 if the
+                   allocation happened before the trace started */
+} ReplayEvent;
+
+/* Live allocation, keyed by its traced address */
+typedef struct LiveSlot {
+    uint64_t address; /* 0 when empty */
+    long index; /* Index of the allocation event, -1 for a deleted slot */
+} LiveSlot;
+
+
+/*--------------------------------------------------------------------------*/
+/* LOCAL FUNCTIONS */
+/*--------------------------------------------------------------------------*/
+
+static int compare_events(const void* _a, const void* _b) {
+    const ReplayEvent* a = (const ReplayEvent*)_a;
+    const ReplayEvent* b = (const ReplayEvent*)_b;
+
+    if (a->event.timestamp != b->event.timestamp) {
+        return a->event.timestamp < b->event.timestamp ? -1 : 1;
+    }
+
+    return a->order < b->order ? -1 : (a->order > b->order);
+}
+
+
+/* Read every event of the trace at _path, returns NULL on error */
+static ReplayEvent* load_trace(const char* _path, size_t* _count) {
+    TraceFileHeader header;
+    TraceEvent event;
+    ReplayEvent* events = NULL;
+    size_t capacity = 0;
+    FILE* file = fopen(_path, "rb");
+
+    *_count = 0;
+
+    if (file == NULL) {
+        printf("\n!--- FAIL (load_trace): Cannot open trace file. ---!\n");
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != TRACE_VERSION || header.event_size != sizeof(TraceEvent)) {
+        printf("\n!--- FAIL (load_trace): Not a compatible trace file. ---!\n");
+        fclose(file);
+        return NULL;
+    }
+
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (*_count == capacity) {
+            capacity = capacity ? capacity * 2 : 65536;
+            events = (ReplayEvent*) realloc(events, capacity * sizeof(ReplayEvent));
+        }
+
+        events[ *_count ].event = event;
+        events[ *_count ].order = (unsigned int)*_count;
+        events[ *_count ].match = -1;
+        ++*_count;
+    }
+
+    fclose(file);
+
+    return events;
+}
+
+
+/* Pair every free with the allocation it releases, so the timed replay needs no
+   address lookups. Returns the peak number of requested bytes live at once, and
+   the index of the event reaching it in _peak_index. */
+static unsigned long long match_frees(ReplayEvent* _events, size_t _count,
+                                      size_t* _peak_index) {
+    size_t capacity = 1;
+    LiveSlot* live = NULL;
+    unsigned long long live_bytes = 0;
+    unsigned long long peak_bytes = 0;
+
+    while (capacity < 2 * _count) {
+        capacity <<= 1;
+    }
+
+    live = (LiveSlot*) calloc(capacity, sizeof(LiveSlot));
+
+    for (size_t i = 0; i < _count; i++) {
+        TraceEvent* event = &_events[i].event;
+        size_t slot = (size_t)((event->address >> 4) * 0x9E3779B97F4A7C15ull) & (capacity - 1);
+
+        if (event->address == 0) {
+            continue;
+        }
+
+        if (event->op == 'M') {
+            while (live[ slot ].address != 0 && live[ slot ].index != -1) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+
+            live[ slot ].address = event->address;
+            live[ slot ].index = (long)i;
+
+            live_bytes += event->size;
+            if (live_bytes > peak_bytes) {
+                peak_bytes = live_bytes;
+                *_peak_index = i;
+            }
+        } else {
+            while (live[ slot ].address != 0) {
+                if (live[ slot ].address == event->address && live[ slot ].index != -1) {
+                    _events[i].match = live[ slot ].index;
+                    live_bytes -= _events[ live[ slot ].index ].event.size;
+                    live[ slot ].index = -1;
+                    break;
+                }
+
+                slot = (slot + 1) & (capacity - 1);
+            }
+        }
+    }
+
+    free(live);
+
+    return peak_bytes;
+}
+
+
+static double elapsed_seconds(struct timespec* _start, struct timespec* _end) {
+    return (double)(_end->tv_sec - _start->tv_sec) +
+           (double)(_end->tv_nsec - _start->tv_nsec) / 1e9;
+}
+
+
+int main(int argc, const char * argv[]) {
+    size_t count = 0;
+    ReplayEvent* events = NULL;
+    void** addresses = NULL;
+    int use_fib = 1;
+    unsigned int basic_block_size = 64;
+    unsigned long long arena_length = 0;
+    unsigned long long peak_bytes = 0;
+    size_t peak_index = 0;
+    HeapSnapshot snapshot;
+    double snapshot_seconds = 0.0;
+    unsigned long allocations = 0, frees = 0, failed = 0, unmatched = 0;
+    struct timespec start, end, snapshot_start, snapshot_end;
+
+    if (argc < 2) {
+        printf("Usage: %s <trace file> [fib|glibc] [basic block size] [arena length]\n",
+               argv[0]);
+        return 1;
+    }
+
+    if (argc > 2) {
+        use_fib = strcmp(argv[2], "glibc") != 0;
+    }
+    if (argc > 3) {
+        basic_block_size = (unsigned int)strtoul(argv[3], NULL, 10);
+    }
+    if (argc > 4) {
+        arena_length = strtoull(argv[4], NULL, 10);
+    }
+
+    events = load_trace(argv[1], &count);
+    if (events == NULL) {
+        return 1;
+    }
+
+    qsort(events, count, sizeof(ReplayEvent), compare_events);
+    peak_bytes = match_frees(events, count, &peak_index);
+    memset(&snapshot, 0, sizeof(snapshot));
+    addresses = (void**) calloc(count ? count : 1, sizeof(void*));
+
+    if (use_fib) {
+        /* Default to twice the peak live footprint, the rest is fragmentation */
+        if (arena_length == 0) {
+            arena_length = 2 * peak_bytes + 1048576;
+        }
+        if (arena_length > UINT_MAX / 2) {
+            arena_length = UINT_MAX / 2;
+        }
+
+        init_allocator(basic_block_size, (unsigned int)arena_length);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t i = 0; i < count; i++) {
+        TraceEvent* event = &events[i].event;
+
+        if (event->op == 'M') {
+            void* addr = use_fib ? my_malloc(event->size) : malloc(event->size);
+
+            ++allocations;
+
+            if (addr == NULL) {
+                ++failed;
+                continue;
+            }
+
+            memset(addr, (int)i, event->size);
+            addresses[i] = addr;
+
+            /* Heap usage at the peak shows the size class rounding overhead,
+               its cost is kept out of the timing */
+            if (use_fib && i == peak_index) {
+                clock_gettime(CLOCK_MONOTONIC, &snapshot_start);
+                get_heap_snapshot(&snapshot, NULL, 0);
+                clock_gettime(CLOCK_MONOTONIC, &snapshot_end);
+                snapshot_seconds = elapsed_seconds(&snapshot_start, &snapshot_end);
+            }
+        } else if (events[i].match < 0 || addresses[ events[i].match ] == NULL) {
+            ++unmatched;
+        } else {
+            if (use_fib) {
+                my_free(addresses[ events[i].match ]);
+            } else {
+                free(addresses[ events[i].match ]);
+            }
+
+            addresses[ events[i].match ] = NULL;
+            ++frees;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsed_seconds(&start, &end) - snapshot_seconds;
+
+    printf("\n\nReplayed %zu events from %s against %s\n", count, argv[1],
+           use_fib ? "my_malloc/my_free" : "malloc/free");
+    printf("Allocations: %lu (%lu failed)\nFrees: %lu (%lu unmatched)\n",
+           allocations, failed, frees, unmatched);
+    printf("Peak live bytes requested: %llu\n", peak_bytes);
+    printf("Time taken: %.6f s, %.1f ns/op\n", seconds,
+           count ? seconds * 1e9 / count : 0.0);
+
+    if (use_fib) {
+        HeapSnapshot final_snapshot;
+
+        get_heap_snapshot(&final_snapshot, NULL, 0);
+
+        if (snapshot.allocated_bytes > 0) {
+            printf("Internal fragmentation at peak: %.2f%% of %llu bytes in use\n",
+                   100.0 * (1.0 - (double)peak_bytes / snapshot.allocated_bytes),
+                   snapshot.allocated_bytes);
+        }
+        printf("Splits per allocation: %.3f, coalesces per free: %.3f\n",
+               allocations ? (double)final_snapshot.split_count / allocations : 0.0,
+               frees ? (double)final_snapshot.coalesce_count / frees : 0.0);
+
+
+        release_allocator();
+        printf("\n");
+    }
+
+    free(addresses);
+    free(events);
+
+    return failed ? 2 : 0;
+}